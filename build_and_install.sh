@@ -24,6 +24,11 @@ go get "github.com/toorpia/go-wav"
 go build -ldflags '-w -s' check_wav_effectiveness.go
 sudo mv check_wav_effectiveness /usr/local/bin
 
+# install emupload (standard library only)
+cd $DIR/emupload
+go build -ldflags '-w -s' emupload.go
+sudo mv emupload /usr/local/bin
+
 # install crontab
 cd $DIR
 crontab -u pi crontab/crontab
@@ -0,0 +1,74 @@
+#include <string.h>
+#include <sndfile.h>
+#include "afe_format.h"
+
+// オフセットバイナリ(LE)のサンプル1個を左詰めint32へ変換する。
+// 16bitは従来どおり raw - 0x7FFF を16bitで折り返した値とする。
+static inline int32_t afe_sample_2(const uint8_t *p) {
+    uint16_t raw = (uint16_t)(p[0] | (p[1] << 8));
+    return (int32_t)((uint32_t)(uint16_t)(raw - 0x7FFF) << 16);
+}
+
+static inline int32_t afe_sample_3(const uint8_t *p) {
+    uint32_t raw = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (int32_t)(((raw - 0x7FFFFF) & 0xFFFFFF) << 8);
+}
+
+static inline void afe_put_2(int32_t v, uint8_t *p) {
+    uint16_t raw = (uint16_t)(((uint32_t)v >> 16) + 0x7FFF);
+    p[0] = raw & 0xFF;
+    p[1] = raw >> 8;
+}
+
+static inline void afe_put_3(int32_t v, uint8_t *p) {
+    uint32_t raw = ((((uint32_t)v >> 8) & 0xFFFFFF) + 0x7FFFFF) & 0xFFFFFF;
+    p[0] = raw & 0xFF;
+    p[1] = (raw >> 8) & 0xFF;
+    p[2] = raw >> 16;
+}
+
+// フォーマット毎にチャンネル数とサンプル幅を定数にしたデコーダを生成する。
+// ループ内でフォーマットによる分岐は発生せず、要求されたチャンネル以外は読みもしない。
+#define DEFINE_AFE_CODEC(NAME, CHANNELS, BYTES) \
+    static void afe_decode_##NAME(const uint8_t *payload, int num_frames, int32_t **out, int offset, const int *channels, int num_out) { \
+        for (int f = 0; f < num_frames; f++) { \
+            const uint8_t *frame = payload + f * (CHANNELS) * (BYTES); \
+            for (int k = 0; k < num_out; k++) { \
+                out[k][offset + f] = afe_sample_##BYTES(frame + channels[k] * (BYTES)); \
+            } \
+        } \
+    } \
+    static void afe_encode_##NAME(int32_t **in, int offset, int num_frames, uint8_t *payload) { \
+        for (int f = 0; f < num_frames; f++) { \
+            uint8_t *frame = payload + f * (CHANNELS) * (BYTES); \
+            for (int ch = 0; ch < (CHANNELS); ch++) { \
+                afe_put_##BYTES(in[ch][offset + f], frame + ch * (BYTES)); \
+            } \
+        } \
+    }
+
+#define AFE_FORMAT(NAME, CHANNELS, BYTES, FRAMES, SF_SUBTYPE) \
+    { #NAME, CHANNELS, BYTES, FRAMES, AFE_HEADER_SIZE + (FRAMES) * (CHANNELS) * (BYTES), 20000, SF_SUBTYPE, \
+      afe_decode_##NAME, afe_encode_##NAME }
+
+DEFINE_AFE_CODEC(4ch16bit, 4, 2)
+DEFINE_AFE_CODEC(8ch16bit, 8, 2)
+DEFINE_AFE_CODEC(4ch24bit, 4, 3)
+DEFINE_AFE_CODEC(8ch24bit, 8, 3)
+
+const AfeFormat afe_formats[] = {
+    AFE_FORMAT(4ch16bit, 4, 2, 128, SF_FORMAT_PCM_16), // 1026 bytes/packet (従来のAFE)
+    AFE_FORMAT(8ch16bit, 8, 2, 64, SF_FORMAT_PCM_16),  // 1026 bytes/packet
+    AFE_FORMAT(4ch24bit, 4, 3, 85, SF_FORMAT_PCM_24),  // 1022 bytes/packet
+    AFE_FORMAT(8ch24bit, 8, 3, 42, SF_FORMAT_PCM_24),  // 1010 bytes/packet
+};
+const int num_afe_formats = sizeof(afe_formats) / sizeof(AfeFormat);
+
+const AfeFormat *afe_format_find(const char *name) {
+    for (int i = 0; i < num_afe_formats; i++) {
+        if (strcmp(afe_formats[i].name, name) == 0) {
+            return &afe_formats[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef AFE_FORMAT_H
+#define AFE_FORMAT_H
+
+// AFEのパケットフォーマット記述子。
+// パケットは 2byteの連番(LE) + frames_per_packet * num_channels * bytes_per_sample のサンプル列
+// (チャンネルがインターリーブされたオフセットバイナリ, LE) からなる。
+// デコード後のサンプルはビット数に関係なく左詰めのint32 (フルスケール = INT32_MAX) で扱う。
+
+#include <stdint.h>
+
+#define AFE_MAX_CHANNELS 8
+#define AFE_MAX_PACKET_SIZE 1026
+#define AFE_HEADER_SIZE 2
+
+typedef struct {
+    const char *name;
+    int num_channels;
+    int bytes_per_sample;
+    int frames_per_packet;
+    int packet_size;
+    int sampling_rate;
+    int sf_format; // libsndfile subtype for the wav files
+    // payload (連番を除いたパケット本体) の先頭 num_frames フレームのうち、channels[0..num_out) の
+    // チャンネルだけを out[k][offset..] (k番目が channels[k]) へデコードする
+    void (*decode)(const uint8_t *payload, int num_frames, int32_t **out, int offset, const int *channels, int num_out);
+    // 試験用 (afesim): out[channel][offset..] をパケット本体へエンコードする
+    void (*encode)(int32_t **in, int offset, int num_frames, uint8_t *payload);
+} AfeFormat;
+
+extern const AfeFormat afe_formats[];
+extern const int num_afe_formats;
+
+#define AFE_DEFAULT_FORMAT "4ch16bit"
+
+const AfeFormat *afe_format_find(const char *name);
+
+#endif // AFE_FORMAT_H
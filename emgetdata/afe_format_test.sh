@@ -0,0 +1,151 @@
+#!/bin/bash
+# AFEフォーマットの適合試験 (make test)。
+# フォーマット毎にafesimを起動してemgetdataで取得し、サンプルストアに書かれた各センサーの
+# 振幅 (afesimの振幅 * チャンネル番号 / チャンネル数 * ゲイン) と周波数 (チャンネルnは50*n Hz) から、
+# デコードとチャンネルの対応を確かめる。ブロックBは-sで一部のチャンネルだけを取得する。
+# afesimがstart毎にパケットの連番を0から始めることと、emgetdataがPacket Lossを報告しないことも確かめる。
+# ブロックにチャンネル数を超えるセンサーを書いた設定が読み込み時にエラーになることも確かめる。
+
+cd "$(dirname "$0")"
+BIN_DIR=$(pwd)
+WORK_DIR=$(mktemp -d)
+PORT=$((40000 + $$ % 10000))
+AMPLITUDE=0.8
+DURATION=0.5
+SAMPLING_RATE=20000 # AFEのサンプリングレートのまま記録する (downsampleしない)
+GAINS=(100 50 100 20 100 50 100 20)
+FORMATS="4ch16bit 8ch16bit 4ch24bit 8ch24bit"
+
+afesim_pid=""
+trap 'if [ -n "$afesim_pid" ]; then kill $afesim_pid 2>/dev/null; fi; rm -rf "$WORK_DIR"' EXIT
+
+failed=0
+
+fail() {
+    echo "FAILED: $*" 1>&2
+    failed=1
+}
+
+# 関数: センサーの取得結果を確かめる
+# 引数: フォーマット, ラベル, チャンネル番号(1-), チャンネル数
+check_sensor() {
+    local format=$1 label=$2 channel=$3 num_channels=$4
+    local gain=${GAINS[$((channel - 1))]}
+    local result
+    result=$("${BIN_DIR}/emstore" -d "${WORK_DIR}/store" -s "$label" 2> /dev/null | awk -F, '
+        { v = $2; a = v < 0 ? -v : v; if (a > peak) peak = a; if (n > 0 && prev < 0 && v >= 0) cycles++; prev = v; n++ }
+        END { printf "%d %.6f %d\n", n, peak, cycles }')
+    read -r samples peak cycles <<< "$result"
+
+    local expected_samples expected_peak expected_cycles
+    expected_samples=$(awk -v d=$DURATION -v r=$SAMPLING_RATE 'BEGIN { printf "%d", d * r }')
+    expected_peak=$(awk -v a=$AMPLITUDE -v c=$channel -v n=$num_channels -v g=$gain 'BEGIN { printf "%.6f", a * c / n * g / 100 }')
+    expected_cycles=$(awk -v c=$channel -v d=$DURATION 'BEGIN { printf "%d", 50 * c * d }')
+    echo "${format} ${label}: ch${channel} gain ${gain}: ${samples} samples, peak ${peak} (expected ${expected_peak}), ${cycles} cycles (expected ${expected_cycles})"
+
+    if [ "$samples" != "$expected_samples" ]; then
+        fail "${format} ${label}: ${samples} samples (expected ${expected_samples})"
+    fi
+    if ! awk -v p=$peak -v e=$expected_peak 'BEGIN { exit !(p - e < 0.01 * e + 0.0001 && e - p < 0.01 * e + 0.0001) }'; then
+        fail "${format} ${label}: peak ${peak} (expected ${expected_peak})"
+    fi
+    if [ $((cycles - expected_cycles)) -gt 1 ] || [ $((expected_cycles - cycles)) -gt 1 ]; then
+        fail "${format} ${label}: ${cycles} cycles (expected ${expected_cycles}). channel mapping is wrong"
+    fi
+}
+
+# 関数: afesimへstartを送り、最初のデータパケットの連番を返す
+first_packet_number() {
+    local fd
+    exec {fd}<>/dev/udp/127.0.0.1/$PORT
+    printf 'OS\001\007\007\007\007' >&$fd
+    # 1つ目はstartの応答 (32 bytes)、2つ目が最初のデータパケット
+    local bytes=($(timeout 2 dd bs=2048 count=2 <&$fd 2> /dev/null | od -An -tu1 -j32 -N2))
+    sleep 0.1
+    printf 'OQ' >&$fd
+    exec {fd}>&-
+    echo $((bytes[0] | bytes[1] << 8))
+}
+
+for format in $FORMATS; do
+    num_channels=${format%%ch*}
+    rm -rf "${WORK_DIR}/store"
+
+    {
+        echo "afe_ip: 127.0.0.1"
+        echo "afe_port: ${PORT}"
+        echo "sensors:"
+        for block in A B; do
+            for channel in $(seq 1 $num_channels); do
+                echo "  - {label: \"${block}${channel}\", block: \"${block}\", channel: \"${channel}\", gain: ${GAINS[$((channel - 1))]}}"
+            done
+        done
+        echo "sampling_rate: ${SAMPLING_RATE}"
+        echo "afe_format: \"${format}\""
+        echo "output: \"store\""
+        echo "sample_store: \"${WORK_DIR}/store\""
+        echo "rawdata_dir: \"${WORK_DIR}/rawdata\""
+    } > "${WORK_DIR}/config.yml"
+
+    "${BIN_DIR}/afesim" -p $PORT -F $format -a $AMPLITUDE 2> "${WORK_DIR}/afesim.log" &
+    afesim_pid=$!
+    sleep 0.3
+
+    for i in 1 2; do
+        packet_number=$(first_packet_number)
+        if [ "$packet_number" != "0" ]; then
+            fail "${format}: the first packet after start #${i} is numbered ${packet_number}"
+        fi
+    done
+
+    # ブロックAは全チャンネル、ブロックBは2番目と最後のチャンネルだけを取得する
+    (cd "$WORK_DIR" && "${BIN_DIR}/emgetdata" -f config.yml -t $DURATION -s "A*,B2,B${num_channels}") > "${WORK_DIR}/emgetdata.log" 2>&1
+    status=$?
+    kill $afesim_pid 2>/dev/null
+    wait $afesim_pid 2>/dev/null
+    afesim_pid=""
+
+    if [ $status -ne 0 ]; then
+        cat "${WORK_DIR}/emgetdata.log" 1>&2
+        fail "${format}: emgetdata exited with ${status}"
+        continue
+    fi
+    if grep -q "Packet Loss" "${WORK_DIR}/emgetdata.log"; then
+        grep "Packet Loss" "${WORK_DIR}/emgetdata.log" 1>&2
+        fail "${format}: packet loss is reported"
+    fi
+
+    for channel in $(seq 1 $num_channels); do
+        check_sensor $format "A${channel}" $channel $num_channels
+    done
+    check_sensor $format B2 2 $num_channels
+    check_sensor $format "B${num_channels}" $num_channels $num_channels
+    stored=$(cd "${WORK_DIR}/store" && ls *.idx | wc -l)
+    if [ "$stored" -ne $((num_channels + 2)) ]; then
+        fail "${format}: ${stored} sensors are stored (expected $((num_channels + 2)))"
+    fi
+done
+
+# ブロックのセンサー数がフォーマットのチャンネル数を超える設定は、超えたセンサーを示してエラーにする
+{
+    echo "afe_ip: 127.0.0.1"
+    echo "afe_port: ${PORT}"
+    echo "sensors:"
+    for channel in 1 2 3 4 5; do
+        echo "  - {label: \"A${channel}\", block: \"A\", channel: \"${channel}\", gain: 100}"
+    done
+    echo "sampling_rate: ${SAMPLING_RATE}"
+    echo "afe_format: \"4ch16bit\""
+} > "${WORK_DIR}/config.yml"
+(cd "$WORK_DIR" && "${BIN_DIR}/emgetdata" -f config.yml -t $DURATION) > "${WORK_DIR}/emgetdata.log" 2>&1
+status=$?
+if [ $status -eq 0 ] || ! grep -q "Error: sensor \[A5\]" "${WORK_DIR}/emgetdata.log"; then
+    cat "${WORK_DIR}/emgetdata.log" 1>&2
+    fail "5 sensors in a block of 4ch16bit are not rejected"
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "afe_format_test: FAILED"
+    exit 1
+fi
+echo "afe_format_test: OK"
@@ -0,0 +1,172 @@
+// AFEシミュレータ: 実機なしでemgetdataを動かすためのUDPサーバ。
+// 'O' 'S' (start) を受けると指定フォーマットのパケットをAFEのサンプリングレートで送り続け、
+// 'O' 'Q' (stop) で停止する。各コマンドには実機と同じく {cmd0, cmd1, 0xA5} を返す。
+// パケットの連番はstart毎に0へ戻す。
+// チャンネルnには周波数 50*(n+1) Hz, 振幅 amplitude*(n+1)/num_channels の正弦波を載せる。
+// 振幅はゲイン100のときの値で、startコマンドで指定されたゲインに比例させ、フルスケールでクリップする。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include "afe_format.h"
+
+void usage() {
+    fprintf(stderr, "Usage: afesim [-p port] [-F format] [-a amplitude] [-l loss_interval]\n");
+    fprintf(stderr, "  -p port: UDP port to listen on. default: 50000\n");
+    fprintf(stderr, "  -F format: packet format. default: %s\n", AFE_DEFAULT_FORMAT);
+    fprintf(stderr, "  -a amplitude: amplitude of the highest channel at gain 100 relative to full scale. default: 0.5\n");
+    fprintf(stderr, "  -l loss_interval: drop every n-th packet. default: 0 (no loss)\n");
+    fprintf(stderr, "  -h: show this help\n");
+    fprintf(stderr, "available formats:");
+    for (int i = 0; i < num_afe_formats; i++) {
+        fprintf(stderr, " %s", afe_formats[i].name);
+    }
+    fputc('\n', stderr);
+}
+
+// startコマンドのゲインバイト -> ゲイン (emgetdataのgain_data_mapと同じ)
+static const int gains[] = { 0, 1, 2, 5, 10, 20, 50, 100 };
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 50000;
+    const AfeFormat *format = afe_format_find(AFE_DEFAULT_FORMAT);
+    double amplitude = 0.5;
+    int loss_interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:F:a:l:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'F':
+                format = afe_format_find(optarg);
+                if (format == NULL) {
+                    fprintf(stderr, "Error: unknown format [%s]\n", optarg);
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'a':
+                amplitude = atof(optarg);
+                break;
+            case 'l':
+                loss_interval = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    fprintf(stderr, "afesim: listening on %d, format %s\n", port, format->name);
+
+    int32_t *samples[AFE_MAX_CHANNELS];
+    for (int ch = 0; ch < format->num_channels; ch++) {
+        samples[ch] = calloc(format->frames_per_packet, sizeof(int32_t));
+    }
+
+    struct sockaddr_in client;
+    socklen_t client_len = sizeof(client);
+    int streaming = 0;
+    uint16_t packet_number = 0;
+    uint64_t frame = 0;
+    double start_time = 0.0;
+    uint8_t packet[AFE_MAX_PACKET_SIZE];
+    double channel_gain[AFE_MAX_CHANNELS];
+
+    while (1) {
+        // 次のパケットの送信時刻までコマンドを待つ
+        struct timeval tv = { 1, 0 };
+        if (streaming) {
+            double wait = start_time + (double)frame / format->sampling_rate - now_sec();
+            if (wait < 0) wait = 0;
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = (long)((wait - tv.tv_sec) * 1e6);
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (select(sock + 1, &fds, NULL, NULL, &tv) > 0) {
+            uint8_t command[32];
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(sock, command, sizeof(command), 0, (struct sockaddr *)&from, &from_len);
+            if (len >= 2 && command[0] == 'O' && (command[1] == 'S' || command[1] == 'Q')) {
+                uint8_t response[32] = { command[0], command[1], 0xA5 };
+                if (command[1] == 'S') {
+                    fprintf(stderr, "afesim: start block 0x%02x, gain", len > 2 ? command[2] : 0);
+                    for (int ch = 0; ch < format->num_channels; ch++) {
+                        int g = 3 + ch < len && command[3 + ch] < sizeof(gains) / sizeof(int) ? gains[command[3 + ch]] : 100;
+                        channel_gain[ch] = g / 100.0;
+                        fprintf(stderr, " %d", g);
+                    }
+                    fputc('\n', stderr);
+                    client = from;
+                    client_len = from_len;
+                    streaming = 1;
+                    frame = 0;
+                    packet_number = 0; // 実機と同じく連番はstart毎に0から始まる (emgetdataはブロック毎に0から数える)
+                    start_time = now_sec();
+                } else {
+                    fprintf(stderr, "afesim: stop\n");
+                    streaming = 0;
+                }
+                sendto(sock, response, sizeof(response), 0, (struct sockaddr *)&from, from_len);
+            }
+            continue;
+        }
+        if (!streaming) {
+            continue;
+        }
+
+        for (int f = 0; f < format->frames_per_packet; f++) {
+            double t = (double)(frame + f) / format->sampling_rate;
+            for (int ch = 0; ch < format->num_channels; ch++) {
+                double a = amplitude * (ch + 1) / format->num_channels * channel_gain[ch];
+                double v = a * sin(2.0 * M_PI * 50.0 * (ch + 1) * t);
+                v = v > 1.0 ? 1.0 : v < -1.0 ? -1.0 : v;
+                samples[ch][f] = (int32_t)(v * 2147483647.0);
+            }
+        }
+        packet[0] = packet_number & 0xFF;
+        packet[1] = packet_number >> 8;
+        format->encode(samples, 0, format->frames_per_packet, packet + AFE_HEADER_SIZE);
+        packet_number++;
+        frame += format->frames_per_packet;
+        if (loss_interval > 0 && packet_number % loss_interval == 0) {
+            continue;
+        }
+        sendto(sock, packet, format->packet_size, 0, (struct sockaddr *)&client, client_len);
+    }
+    return 0;
+}
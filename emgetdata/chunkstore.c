@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chunkstore.h"
+#include "debug.h"
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint32_t crc = 0xFFFFFFFF;
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+static uint32_t record_crc(const ChunkRecord *rec) {
+    return crc32(rec, offsetof(ChunkRecord, record_crc));
+}
+
+static off_t record_offset(uint64_t record) {
+    return sizeof(ChunkStoreHeader) + (off_t)record * sizeof(ChunkRecord);
+}
+
+// ラベルをファイル名に使うので'/'は置き換える
+static void store_path(char *path, size_t size, const char *dir, const char *label, const char *ext) {
+    int len = snprintf(path, size, "%s/", dir);
+    for (const char *p = label; *p != '\0' && len < (int)size - 5; p++) {
+        path[len++] = (*p == '/') ? '_' : *p;
+    }
+    snprintf(path + len, size - len, ".%s", ext);
+}
+
+// チャンクの圧縮: 全サンプルに共通する下位の0ビット (16bitフォーマットなら16bit) を落とし、
+// 前のサンプルとの差分をzigzag + varintで符号化する
+static uint32_t encode_chunk(const int32_t *samples, int num_samples, uint8_t *out, uint32_t *shift) {
+    uint32_t bits = 0;
+    for (int i = 0; i < num_samples; i++) {
+        bits |= (uint32_t)samples[i];
+    }
+    *shift = bits == 0 ? 0 : __builtin_ctz(bits);
+
+    uint32_t len = 0;
+    int64_t prev = 0;
+    for (int i = 0; i < num_samples; i++) {
+        int64_t v = samples[i] >> *shift;
+        int64_t delta = v - prev;
+        uint64_t zz = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+        while (zz >= 0x80) {
+            out[len++] = (uint8_t)(zz | 0x80);
+            zz >>= 7;
+        }
+        out[len++] = (uint8_t)zz;
+        prev = v;
+    }
+    return len;
+}
+
+static int decode_chunk(const uint8_t *in, uint32_t length, int num_samples, uint32_t shift, int32_t *out) {
+    uint32_t pos = 0;
+    int64_t prev = 0;
+    for (int i = 0; i < num_samples; i++) {
+        uint64_t zz = 0;
+        for (int bit = 0; ; bit += 7) {
+            if (pos >= length || bit > 63) {
+                return -1;
+            }
+            zz |= (uint64_t)(in[pos] & 0x7F) << bit;
+            if ((in[pos++] & 0x80) == 0) {
+                break;
+            }
+        }
+        prev += (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+        out[i] = (int32_t)((uint32_t)prev << shift);
+    }
+    return pos == length ? num_samples : -1;
+}
+
+static int valid_record(const ChunkRecord *rec, size_t dat_size) {
+    return rec->record_crc == record_crc(rec) && rec->offset + rec->length <= dat_size
+        && rec->num_samples <= CHUNKSTORE_CHUNK_SAMPLES && rec->sample_rate > 0;
+}
+
+// chunkstore_trimの書き写し先
+static void new_path(char *path, size_t size, const char *store_path) {
+    snprintf(path, size, "%s.new", store_path);
+}
+
+// renameをディスクへ反映させる
+static void sync_parent(const char *path) {
+    char dir[CHUNKSTORE_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// 前回のchunkstore_trimが途中で終わっていた場合の後始末。
+// idx.newが残っていれば入れ替える前なので書き写しを捨て、dat.newだけが残っていればidxは入れ替え済みなのでdatも入れ替える
+static int finish_trim(ChunkStore *cs) {
+    char idx_new[CHUNKSTORE_PATH_LEN + 8], dat_new[CHUNKSTORE_PATH_LEN + 8];
+    new_path(idx_new, sizeof(idx_new), cs->idx_path);
+    new_path(dat_new, sizeof(dat_new), cs->dat_path);
+    if (access(idx_new, F_OK) == 0) {
+        fprintf(stderr, "chunkstore: %s: discarding an interrupted trim\n", cs->label);
+        unlink(idx_new);
+        unlink(dat_new);
+    } else if (access(dat_new, F_OK) == 0) {
+        fprintf(stderr, "chunkstore: %s: completing an interrupted trim\n", cs->label);
+        if (rename(dat_new, cs->dat_path) < 0) {
+            return -1;
+        }
+        sync_parent(cs->dat_path);
+        close(cs->dat_fd);
+        cs->dat_fd = open(cs->dat_path, O_RDWR | O_CREAT, 0644);
+        if (cs->dat_fd < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ChunkStore *chunkstore_open(const char *dir, const char *label) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: failed to create sample store [%s]: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    ChunkStore *cs = calloc(1, sizeof(ChunkStore));
+    snprintf(cs->label, sizeof(cs->label), "%s", label);
+    store_path(cs->idx_path, sizeof(cs->idx_path), dir, label, "idx");
+    cs->idx_fd = open(cs->idx_path, O_RDWR | O_CREAT, 0644);
+    store_path(cs->dat_path, sizeof(cs->dat_path), dir, label, "dat");
+    cs->dat_fd = open(cs->dat_path, O_RDWR | O_CREAT, 0644);
+    if (cs->idx_fd < 0 || cs->dat_fd < 0) {
+        fprintf(stderr, "Error: failed to open sample store [%s]: %s\n", cs->idx_fd < 0 ? cs->idx_path : cs->dat_path, strerror(errno));
+        chunkstore_close(cs);
+        return NULL;
+    }
+
+    // 新しいストアならヘッダを書き、既存のものなら形式を確認する
+    ChunkStoreHeader header;
+    flock(cs->idx_fd, LOCK_EX);
+    if (finish_trim(cs) < 0) {
+        fprintf(stderr, "Error: failed to complete the trim of sample store for %s: %s\n", label, strerror(errno));
+        flock(cs->idx_fd, LOCK_UN);
+        chunkstore_close(cs);
+        return NULL;
+    }
+    if (pread(cs->idx_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHUNKSTORE_MAGIC, sizeof(CHUNKSTORE_MAGIC));
+        header.version = CHUNKSTORE_VERSION;
+        header.record_size = sizeof(ChunkRecord);
+        header.chunk_samples = CHUNKSTORE_CHUNK_SAMPLES;
+        snprintf(header.label, sizeof(header.label), "%s", label);
+        if (ftruncate(cs->idx_fd, 0) < 0 || pwrite(cs->idx_fd, &header, sizeof(header), 0) != sizeof(header) || fsync(cs->idx_fd) < 0) {
+            fprintf(stderr, "Error: failed to initialize sample store index for %s: %s\n", label, strerror(errno));
+            flock(cs->idx_fd, LOCK_UN);
+            chunkstore_close(cs);
+            return NULL;
+        }
+    } else if (memcmp(header.magic, CHUNKSTORE_MAGIC, sizeof(CHUNKSTORE_MAGIC)) != 0
+               || header.version != CHUNKSTORE_VERSION || header.record_size != sizeof(ChunkRecord)) {
+        fprintf(stderr, "Error: sample store index for %s has an unknown format\n", label);
+        flock(cs->idx_fd, LOCK_UN);
+        chunkstore_close(cs);
+        return NULL;
+    }
+    flock(cs->idx_fd, LOCK_UN);
+    return cs;
+}
+
+// 前回の書き込みが途中で終わっていた場合に備え、末尾の不完全なレコードと
+// インデックスから参照されていないデータを切り詰める。有効なレコード数を返す
+static uint64_t recover(ChunkStore *cs, uint64_t *data_end) {
+    struct stat idx_st, dat_st;
+    ChunkRecord rec;
+    uint8_t chunk[CHUNKSTORE_MAX_CHUNK_BYTES];
+
+    fstat(cs->idx_fd, &idx_st);
+    fstat(cs->dat_fd, &dat_st);
+    uint64_t count = 0;
+    if (idx_st.st_size > (off_t)sizeof(ChunkStoreHeader)) {
+        count = (idx_st.st_size - sizeof(ChunkStoreHeader)) / sizeof(ChunkRecord);
+    }
+    uint64_t valid = count;
+    *data_end = 0;
+    while (valid > 0) {
+        if (pread(cs->idx_fd, &rec, sizeof(rec), record_offset(valid - 1)) == sizeof(rec)
+            && valid_record(&rec, dat_st.st_size) && rec.length <= sizeof(chunk)
+            && pread(cs->dat_fd, chunk, rec.length, rec.offset) == (ssize_t)rec.length
+            && crc32(chunk, rec.length) == rec.data_crc) {
+            *data_end = rec.offset + rec.length;
+            break;
+        }
+        valid--;
+    }
+
+    if (idx_st.st_size != record_offset(valid)) {
+        fprintf(stderr, "chunkstore: %s: recovering from an interrupted write (%llu records discarded)\n", cs->label, (unsigned long long)(count - valid));
+        if (ftruncate(cs->idx_fd, record_offset(valid)) < 0) {
+            perror("chunkstore: ftruncate (idx)");
+        }
+    }
+    if ((uint64_t)dat_st.st_size > *data_end) {
+        DEBUG_PRINT("chunkstore: %s: truncating unindexed data %lld -> %llu\n", cs->label, (long long)dat_st.st_size, (unsigned long long)*data_end);
+        if (ftruncate(cs->dat_fd, *data_end) < 0) {
+            perror("chunkstore: ftruncate (dat)");
+        }
+    }
+    return valid;
+}
+
+// 1回の取得分のサンプルをチャンクに分けて追記する。成功すれば0、失敗すれば-1を返す。
+// 失敗した場合もそれまでのデータには触れていない。start_nsが前回の末尾より前なら末尾へ詰める
+int chunkstore_append(ChunkStore *cs, int64_t start_ns, int sample_rate, const int32_t *samples, int num_samples) {
+    int num_chunks = (num_samples + CHUNKSTORE_CHUNK_SAMPLES - 1) / CHUNKSTORE_CHUNK_SAMPLES;
+    ChunkRecord *records = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(ChunkRecord));
+    uint8_t *chunk = malloc(CHUNKSTORE_MAX_CHUNK_BYTES);
+    int retval = 0;
+
+    flock(cs->idx_fd, LOCK_EX);
+    uint64_t data_end;
+    uint64_t count = recover(cs, &data_end);
+
+    // インデックスは時刻順でなければ二分探索できない。時計が戻った場合 (NTPの補正、RTCの無いボードの起動直後) は
+    // 前回の末尾へ詰めて記録する
+    ChunkRecord last;
+    if (count > 0 && pread(cs->idx_fd, &last, sizeof(last), record_offset(count - 1)) == sizeof(last)
+        && start_ns < chunkstore_end_ns(&last)) {
+        fprintf(stderr, "Warning: sample store for %s: capture time is %.3f sec before the end of the previous capture (clock stepped back?). "
+                "recorded at the end of the previous capture\n", cs->label, (chunkstore_end_ns(&last) - start_ns) / 1e9);
+        start_ns = chunkstore_end_ns(&last);
+    }
+
+    // データを先に書いてディスクへ反映させる
+    uint64_t offset = data_end;
+    for (int c = 0; c < num_chunks && retval == 0; c++) {
+        const int32_t *s = samples + c * CHUNKSTORE_CHUNK_SAMPLES;
+        int n = num_samples - c * CHUNKSTORE_CHUNK_SAMPLES;
+        if (n > CHUNKSTORE_CHUNK_SAMPLES) {
+            n = CHUNKSTORE_CHUNK_SAMPLES;
+        }
+        ChunkRecord *rec = &records[c];
+        rec->start_ns = start_ns + (int64_t)((double)c * CHUNKSTORE_CHUNK_SAMPLES * 1e9 / sample_rate);
+        rec->offset = offset;
+        rec->length = encode_chunk(s, n, chunk, &rec->shift);
+        rec->num_samples = n;
+        rec->sample_rate = sample_rate;
+        rec->min = INT32_MAX;
+        rec->max = INT32_MIN;
+        double sum_sq = 0.0;
+        for (int i = 0; i < n; i++) {
+            rec->min = s[i] < rec->min ? s[i] : rec->min;
+            rec->max = s[i] > rec->max ? s[i] : rec->max;
+            double v = s[i] / 2147483648.0;
+            sum_sq += v * v;
+        }
+        rec->rms = (float)sqrt(sum_sq / n);
+        rec->data_crc = crc32(chunk, rec->length);
+        rec->record_crc = record_crc(rec);
+        if (pwrite(cs->dat_fd, chunk, rec->length, offset) != (ssize_t)rec->length) {
+            retval = -1;
+        }
+        offset += rec->length;
+    }
+    if (retval == 0 && fdatasync(cs->dat_fd) < 0) {
+        retval = -1;
+    }
+
+    // データが確定してからインデックスを追記する
+    size_t records_size = num_chunks * sizeof(ChunkRecord);
+    if (retval == 0 && num_chunks > 0) {
+        if (pwrite(cs->idx_fd, records, records_size, record_offset(count)) != (ssize_t)records_size || fdatasync(cs->idx_fd) < 0) {
+            retval = -1;
+        }
+    }
+    if (retval < 0) {
+        fprintf(stderr, "Error: failed to append to sample store for %s: %s\n", cs->label, strerror(errno));
+        recover(cs, &data_end);
+    }
+    flock(cs->idx_fd, LOCK_UN);
+
+    free(chunk);
+    free(records);
+    return retval;
+}
+
+// ストア (<label>.dat + <label>.idx) がmax_bytesを超えていれば、古いチャンクから捨ててmax_bytesの
+// CHUNKSTORE_TRIM_PERCENT%以下にする (最新のチャンクは残す)。捨てたチャンク数を返し、失敗すれば-1を返す。
+// 残すチャンクとインデックスを <label>.dat.new, <label>.idx.new へ書き写してfsyncし、idx -> datの順にrenameする。
+// 途中で落ちても、次に開いたときにfinish_trimでどちらかの状態へ揃える
+int chunkstore_trim(ChunkStore *cs, int64_t max_bytes) {
+    char idx_new[CHUNKSTORE_PATH_LEN + 8], dat_new[CHUNKSTORE_PATH_LEN + 8];
+    ChunkStoreHeader header;
+    int retval = 0;
+
+    flock(cs->idx_fd, LOCK_EX);
+    uint64_t data_end;
+    uint64_t count = recover(cs, &data_end);
+    int64_t size = record_offset(count) + (int64_t)data_end;
+    if (max_bytes <= 0 || size <= max_bytes || count < 2) {
+        flock(cs->idx_fd, LOCK_UN);
+        return 0;
+    }
+    ChunkRecord *records = malloc(count * sizeof(ChunkRecord));
+    if (pread(cs->idx_fd, &header, sizeof(header), 0) != sizeof(header)
+        || pread(cs->idx_fd, records, count * sizeof(ChunkRecord), record_offset(0)) != (ssize_t)(count * sizeof(ChunkRecord))) {
+        fprintf(stderr, "Error: failed to read sample store index for %s: %s\n", cs->label, strerror(errno));
+        free(records);
+        flock(cs->idx_fd, LOCK_UN);
+        return -1;
+    }
+
+    // チャンクは追記順に隙間なく並んでいるので、先頭のfirst個を捨てるとデータはrecords[first].offsetから残る
+    int64_t target = max_bytes * CHUNKSTORE_TRIM_PERCENT / 100;
+    uint64_t first = 1;
+    while (first < count - 1 && record_offset(count - first) + (int64_t)(data_end - records[first].offset) > target) {
+        first++;
+    }
+    uint64_t base = records[first].offset;
+    for (uint64_t i = first; i < count; i++) {
+        records[i].offset -= base;
+        records[i].record_crc = record_crc(&records[i]);
+    }
+
+    // インデックスを先に書き写す (idx.newがある間は入れ替え前とみなされる)
+    new_path(idx_new, sizeof(idx_new), cs->idx_path);
+    new_path(dat_new, sizeof(dat_new), cs->dat_path);
+    size_t records_size = (count - first) * sizeof(ChunkRecord);
+    int fd = open(idx_new, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+        || pwrite(fd, records + first, records_size, record_offset(0)) != (ssize_t)records_size || fsync(fd) < 0) {
+        retval = -1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (retval == 0) {
+        uint8_t *buf = malloc(1 << 20);
+        fd = open(dat_new, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            retval = -1;
+        }
+        for (uint64_t pos = base; retval == 0 && pos < data_end; ) {
+            size_t len = data_end - pos < (1 << 20) ? data_end - pos : (1 << 20);
+            if (pread(cs->dat_fd, buf, len, pos) != (ssize_t)len || pwrite(fd, buf, len, pos - base) != (ssize_t)len) {
+                retval = -1;
+            }
+            pos += len;
+        }
+        if (retval == 0 && fsync(fd) < 0) {
+            retval = -1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(buf);
+    }
+    if (retval < 0) {
+        fprintf(stderr, "Error: failed to trim sample store for %s: %s\n", cs->label, strerror(errno));
+        unlink(idx_new);
+        unlink(dat_new);
+        free(records);
+        flock(cs->idx_fd, LOCK_UN);
+        return -1;
+    }
+
+    if (rename(idx_new, cs->idx_path) < 0) {
+        fprintf(stderr, "Error: failed to trim sample store for %s: %s\n", cs->label, strerror(errno));
+        unlink(idx_new);
+        unlink(dat_new);
+        free(records);
+        flock(cs->idx_fd, LOCK_UN);
+        return -1;
+    }
+    sync_parent(cs->idx_path);
+    // ここで落ちた場合はfinish_trimがdat.newを入れ替える
+    if (rename(dat_new, cs->dat_path) < 0) {
+        fprintf(stderr, "Error: failed to trim sample store for %s: %s\n", cs->label, strerror(errno));
+        retval = -1;
+    }
+    sync_parent(cs->dat_path);
+    DEBUG_PRINT("chunkstore: %s: dropped %llu chunks (%lld -> %lld bytes)\n", cs->label, (unsigned long long)first,
+                (long long)size, (long long)(record_offset(count - first) + (int64_t)(data_end - base)));
+    free(records);
+
+    // 入れ替えたファイルを開き直す (古いファイルのロックはcloseで外れる)
+    close(cs->idx_fd);
+    close(cs->dat_fd);
+    cs->idx_fd = open(cs->idx_path, O_RDWR);
+    cs->dat_fd = open(cs->dat_path, O_RDWR);
+    if (cs->idx_fd < 0 || cs->dat_fd < 0) {
+        return -1;
+    }
+    return retval < 0 ? -1 : (int)first;
+}
+
+void chunkstore_close(ChunkStore *cs) {
+    if (cs == NULL) {
+        return;
+    }
+    if (cs->idx_fd >= 0) {
+        close(cs->idx_fd);
+    }
+    if (cs->dat_fd >= 0) {
+        close(cs->dat_fd);
+    }
+    free(cs);
+}
+
+ChunkStoreReader *chunkstore_map(const char *dir, const char *label) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    store_path(path, sizeof(path), dir, label, "idx");
+    int idx_fd = open(path, O_RDONLY);
+    if (idx_fd < 0) {
+        return NULL;
+    }
+    // 書き込み側がidxを入れ替えてdatをまだ入れ替えていなければ、dat.newが新しいidxに対応する
+    char idx_new[PATH_MAX + 8], dat_new[PATH_MAX + 8];
+    new_path(idx_new, sizeof(idx_new), path);
+    store_path(path, sizeof(path), dir, label, "dat");
+    new_path(dat_new, sizeof(dat_new), path);
+    int dat_fd = -1;
+    if (access(idx_new, F_OK) < 0) {
+        dat_fd = open(dat_new, O_RDONLY);
+    }
+    if (dat_fd < 0) {
+        dat_fd = open(path, O_RDONLY);
+    }
+    if (dat_fd < 0) {
+        close(idx_fd);
+        return NULL;
+    }
+
+    ChunkStoreReader *reader = calloc(1, sizeof(ChunkStoreReader));
+    fstat(idx_fd, &st);
+    reader->idx_size = st.st_size;
+    fstat(dat_fd, &st);
+    reader->dat_size = st.st_size;
+    if (reader->idx_size < sizeof(ChunkStoreHeader)) {
+        goto fail;
+    }
+    reader->header = mmap(NULL, reader->idx_size, PROT_READ, MAP_SHARED, idx_fd, 0);
+    if (reader->header == MAP_FAILED) {
+        reader->header = NULL;
+        goto fail;
+    }
+    if (memcmp(reader->header->magic, CHUNKSTORE_MAGIC, sizeof(CHUNKSTORE_MAGIC)) != 0
+        || reader->header->version != CHUNKSTORE_VERSION || reader->header->record_size != sizeof(ChunkRecord)) {
+        fprintf(stderr, "Error: sample store index for %s has an unknown format\n", label);
+        goto fail;
+    }
+    if (reader->dat_size > 0) {
+        reader->data = mmap(NULL, reader->dat_size, PROT_READ, MAP_SHARED, dat_fd, 0);
+        if (reader->data == MAP_FAILED) {
+            reader->data = NULL;
+            goto fail;
+        }
+    }
+    close(idx_fd);
+    close(dat_fd);
+
+    // 書き込み中のレコードは末尾にしか無いので、末尾から有効なレコードまで戻る
+    reader->records = (const ChunkRecord *)(reader->header + 1);
+    reader->num_records = (reader->idx_size - sizeof(ChunkStoreHeader)) / sizeof(ChunkRecord);
+    while (reader->num_records > 0 && !valid_record(&reader->records[reader->num_records - 1], reader->dat_size)) {
+        reader->num_records--;
+    }
+    return reader;
+
+fail:
+    close(idx_fd);
+    close(dat_fd);
+    chunkstore_unmap(reader);
+    return NULL;
+}
+
+int64_t chunkstore_end_ns(const ChunkRecord *rec) {
+    return rec->start_ns + (int64_t)((double)rec->num_samples * 1e9 / rec->sample_rate);
+}
+
+// t_ns を含むか、それ以降で最初のチャンクの番号を返す (無ければnum_records)
+uint64_t chunkstore_find(const ChunkStoreReader *reader, int64_t t_ns) {
+    uint64_t lo = 0, hi = reader->num_records;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (chunkstore_end_ns(&reader->records[mid]) <= t_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// チャンクを展開してoutへ書き、サンプル数を返す。壊れていれば-1を返す
+int chunkstore_decode(const ChunkStoreReader *reader, const ChunkRecord *rec, int32_t *out) {
+    if (rec->offset + rec->length > reader->dat_size) {
+        return -1;
+    }
+    const uint8_t *chunk = reader->data + rec->offset;
+    if (crc32(chunk, rec->length) != rec->data_crc) {
+        return -1;
+    }
+    return decode_chunk(chunk, rec->length, rec->num_samples, rec->shift, out);
+}
+
+void chunkstore_unmap(ChunkStoreReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    if (reader->header != NULL) {
+        munmap((void *)reader->header, reader->idx_size);
+    }
+    if (reader->data != NULL) {
+        munmap((void *)reader->data, reader->dat_size);
+    }
+    free(reader);
+}
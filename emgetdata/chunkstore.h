@@ -0,0 +1,79 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+// センサー毎の時系列ストア。取得毎のWAVファイルの代わりに(または加えて)、サンプルを
+// センサー毎の <label>.dat へ固定サンプル数のチャンク単位で圧縮して追記し、
+// <label>.idx へチャンク毎の開始時刻・位置・min/max/RMSを固定長レコードで追記する。
+// インデックスは時刻順に並ぶので、読み出し側はmmapして二分探索し、必要なチャンクだけを展開できる。
+// 書き込みはデータ -> fdatasync -> インデックス -> fdatasync の順に行い、既存の領域は書き換えない。
+// 途中で落ちた場合は次に開いたときに、インデックスで参照されていない末尾を切り詰める。
+// 容量を制限する場合は、古いチャンクを捨てて残りを書き写したファイルへ入れ替える (chunkstore_trim)。
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CHUNKSTORE_MAGIC "EMCHK1"
+#define CHUNKSTORE_VERSION 1
+#define CHUNKSTORE_CHUNK_SAMPLES 4096 // samples per chunk (the last chunk of a capture may be shorter)
+#define CHUNKSTORE_MAX_CHUNK_BYTES (CHUNKSTORE_CHUNK_SAMPLES * 5)
+#define CHUNKSTORE_LABEL_LEN 32
+#define CHUNKSTORE_PATH_LEN 1024
+#define CHUNKSTORE_TRIM_PERCENT 75 // 上限を超えたらこの割合(%)まで古いチャンクを捨てる (書き写しの回数を減らすため)
+
+// <label>.idx の先頭 (64 bytes)
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;  // sizeof(ChunkRecord)
+    uint32_t chunk_samples;
+    char label[CHUNKSTORE_LABEL_LEN];
+    char reserved[12];
+} ChunkStoreHeader;
+
+// チャンク毎のインデックスレコード (64 bytes)。サンプルは左詰めint32 (フルスケール = INT32_MAX)
+typedef struct {
+    int64_t start_ns;      // time of the first sample (ns since the epoch)
+    uint64_t offset;       // offset of the compressed chunk in <label>.dat
+    uint32_t length;       // compressed bytes
+    uint32_t num_samples;
+    uint32_t sample_rate;
+    uint32_t shift;        // common trailing zero bits removed before compression
+    int32_t min;
+    int32_t max;
+    float rms;             // relative to full scale
+    uint32_t data_crc;     // crc32 of the compressed chunk
+    uint32_t reserved[3];
+    uint32_t record_crc;   // crc32 of the fields above
+} ChunkRecord;
+
+// writer
+typedef struct {
+    int idx_fd;
+    int dat_fd;
+    char label[CHUNKSTORE_LABEL_LEN];
+    char idx_path[CHUNKSTORE_PATH_LEN];
+    char dat_path[CHUNKSTORE_PATH_LEN];
+} ChunkStore;
+
+ChunkStore *chunkstore_open(const char *dir, const char *label);
+int chunkstore_append(ChunkStore *cs, int64_t start_ns, int sample_rate, const int32_t *samples, int num_samples);
+int chunkstore_trim(ChunkStore *cs, int64_t max_bytes);
+void chunkstore_close(ChunkStore *cs);
+
+// reader (read only mmap)
+typedef struct {
+    const ChunkStoreHeader *header;
+    const ChunkRecord *records;
+    uint64_t num_records; // valid records only
+    const uint8_t *data;
+    size_t idx_size;
+    size_t dat_size;
+} ChunkStoreReader;
+
+ChunkStoreReader *chunkstore_map(const char *dir, const char *label);
+uint64_t chunkstore_find(const ChunkStoreReader *reader, int64_t t_ns);
+int64_t chunkstore_end_ns(const ChunkRecord *rec);
+int chunkstore_decode(const ChunkStoreReader *reader, const ChunkRecord *rec, int32_t *out);
+void chunkstore_unmap(ChunkStoreReader *reader);
+
+#endif // CHUNKSTORE_H
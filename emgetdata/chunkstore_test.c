@@ -0,0 +1,431 @@
+// サンプルストアのテスト (make test)。
+// - recover(): 途中で終わった書き込み (インデックス末尾の不完全なレコード、参照されていないデータ、
+//   途中までしか書かれていないチャンク) が次の追記で切り詰められること
+// - CRCが一致しないチャンクは読み出しで飛ばされ、前後のチャンクは読めること
+// - 二分探索 (chunkstore_find) とemstoreの範囲指定が、チャンクの境界ちょうどで正しいサンプルを返すこと
+// - 前回より前の時刻の取得 (時計が戻った場合) が前回の末尾へ詰めて記録され、インデックスが時刻順のままであること
+// - chunkstore_trimが上限を超えた分を古いチャンクから捨てること、書き写しの途中で落ちても次に開いたときに揃うこと
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "chunkstore.h"
+
+#define RATE 1000                   // 1サンプル1msなので、チャンクの境界は4.096秒毎
+#define PERIOD_NS (1000000000LL / RATE)
+#define T0_NS (1000LL * 1000000000LL) // emstoreへ秒の小数で渡しても誤差が出ない大きさにする
+#define CAPTURE1 (3 * CHUNKSTORE_CHUNK_SAMPLES + 100) // 最後のチャンクが短い
+#define CAPTURE2 CHUNKSTORE_CHUNK_SAMPLES
+#define T1_NS (T0_NS + 100LL * 1000000000LL)          // 2回目の取得 (1回目との間は空いている)
+
+static char dir[256];
+static char emstore[512];
+static int failed = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAILED (line %d): ", __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            failed = 1; \
+        } \
+    } while (0)
+
+// 取得毎に異なる、16bitフォーマットと同じく下位16bitが0のサンプル
+static int32_t sample_value(int capture, int i) {
+    return (int32_t)((uint32_t)((capture * 7919 + i * 31) & 0xFFFF) << 16);
+}
+
+static void append_capture(const char *label, int capture, int64_t start_ns, int num_samples) {
+    int32_t *samples = malloc(num_samples * sizeof(int32_t));
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = sample_value(capture, i);
+    }
+    ChunkStore *cs = chunkstore_open(dir, label);
+    CHECK(cs != NULL, "chunkstore_open(%s)", label);
+    if (cs != NULL) {
+        CHECK(chunkstore_append(cs, start_ns, RATE, samples, num_samples) == 0, "chunkstore_append(%s)", label);
+        chunkstore_close(cs);
+    }
+    free(samples);
+}
+
+static off_t file_size(const char *label, const char *ext) {
+    char path[512];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, label, ext);
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void truncate_file(const char *label, const char *ext, off_t size) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, label, ext);
+    CHECK(truncate(path, size) == 0, "truncate %s", path);
+}
+
+static void append_garbage(const char *label, const char *ext, int len) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, label, ext);
+    FILE *fp = fopen(path, "ab");
+    for (int i = 0; i < len; i++) {
+        fputc(0x5A, fp);
+    }
+    fclose(fp);
+}
+
+// 全チャンクを展開し、取得 (capture, 先頭からのサンプル数) の並びと一致するか確かめる
+static void check_decoded(const char *label, const int *captures, const int *lengths, int num_captures) {
+    ChunkStoreReader *reader = chunkstore_map(dir, label);
+    CHECK(reader != NULL, "chunkstore_map(%s)", label);
+    if (reader == NULL) {
+        return;
+    }
+    int32_t samples[CHUNKSTORE_CHUNK_SAMPLES];
+    uint64_t record = 0;
+    for (int c = 0; c < num_captures; c++) {
+        for (int i = 0; i < lengths[c]; record++) {
+            CHECK(record < reader->num_records, "%s: only %llu records", label, (unsigned long long)reader->num_records);
+            if (record >= reader->num_records) {
+                chunkstore_unmap(reader);
+                return;
+            }
+            int n = chunkstore_decode(reader, &reader->records[record], samples);
+            CHECK(n == (int)reader->records[record].num_samples, "%s: chunk %llu is not decoded", label, (unsigned long long)record);
+            for (int j = 0; j < n; j++) {
+                if (samples[j] != sample_value(captures[c], i + j)) {
+                    CHECK(0, "%s: chunk %llu sample %d differs", label, (unsigned long long)record, j);
+                    break;
+                }
+            }
+            i += n;
+        }
+    }
+    CHECK(record == reader->num_records, "%s: %llu records (expected %llu)", label, (unsigned long long)reader->num_records, (unsigned long long)record);
+    chunkstore_unmap(reader);
+}
+
+// データファイルが最後のチャンクでちょうど終わっているか確かめる
+static void check_data_end(const char *label) {
+    ChunkStoreReader *reader = chunkstore_map(dir, label);
+    if (reader == NULL || reader->num_records == 0) {
+        CHECK(0, "%s: no records", label);
+        chunkstore_unmap(reader);
+        return;
+    }
+    const ChunkRecord *last = &reader->records[reader->num_records - 1];
+    CHECK(file_size(label, "dat") == (off_t)(last->offset + last->length), "%s: data file is %lld bytes (last chunk ends at %llu)", label,
+          (long long)file_size(label, "dat"), (unsigned long long)(last->offset + last->length));
+    chunkstore_unmap(reader);
+}
+
+static void test_recover(void) {
+    const int captures[] = { 1, 2 };
+    const int lengths[] = { CAPTURE1, CAPTURE2 };
+
+    // インデックスの書き込みが途中で終わり、参照されていないデータが残った状態
+    append_capture("R", 1, T0_NS, CAPTURE1);
+    off_t idx_size = file_size("R", "idx");
+    off_t dat_size = file_size("R", "dat");
+    // 次の追記より長く残しておき、上書きだけでは消えないようにする
+    append_garbage("R", "dat", 64 * 1024);
+    append_garbage("R", "idx", sizeof(ChunkRecord) * 3 / 2);
+    append_capture("R", 2, T1_NS, CAPTURE2);
+    CHECK((file_size("R", "idx") - idx_size) == (off_t)sizeof(ChunkRecord), "torn index records are not truncated");
+    check_decoded("R", captures, lengths, 2);
+    check_data_end("R");
+    ChunkStoreReader *reader = chunkstore_map(dir, "R");
+    if (reader != NULL) {
+        CHECK(reader->records[4].offset == (uint64_t)dat_size, "unindexed data is not truncated: chunk at %llu (expected %lld)",
+              (unsigned long long)reader->records[4].offset, (long long)dat_size);
+        chunkstore_unmap(reader);
+    }
+
+    // 最後のチャンクのデータが途中までしか無い状態: そのレコードごと捨てる
+    truncate_file("R", "dat", file_size("R", "dat") - 10);
+    reader = chunkstore_map(dir, "R");
+    if (reader != NULL) {
+        CHECK(reader->num_records == 4, "reader sees %llu records of a torn chunk (expected 4)", (unsigned long long)reader->num_records);
+        chunkstore_unmap(reader);
+    }
+    append_capture("R", 3, T1_NS + 10LL * 1000000000LL, 100);
+    const int recovered_captures[] = { 1, 3 };
+    const int recovered_lengths[] = { CAPTURE1, 100 };
+    check_decoded("R", recovered_captures, recovered_lengths, 2);
+    check_data_end("R");
+}
+
+static void test_crc(void) {
+    append_capture("C", 1, T0_NS, CAPTURE1);
+    ChunkStoreReader *reader = chunkstore_map(dir, "C");
+    CHECK(reader != NULL && reader->num_records == 4, "chunkstore_map(C)");
+    if (reader == NULL) {
+        return;
+    }
+    uint64_t offset = reader->records[1].offset + reader->records[1].length / 2;
+    chunkstore_unmap(reader);
+
+    // 2番目のチャンクのデータを1バイト壊す
+    char path[512];
+    snprintf(path, sizeof(path), "%s/C.dat", dir);
+    int fd = open(path, O_RDWR);
+    uint8_t byte;
+    CHECK(pread(fd, &byte, 1, offset) == 1, "pread");
+    byte ^= 0x01;
+    CHECK(pwrite(fd, &byte, 1, offset) == 1, "pwrite");
+    close(fd);
+
+    int32_t samples[CHUNKSTORE_CHUNK_SAMPLES];
+    reader = chunkstore_map(dir, "C");
+    CHECK(chunkstore_decode(reader, &reader->records[1], samples) < 0, "corrupted chunk is decoded");
+    CHECK(chunkstore_decode(reader, &reader->records[0], samples) == CHUNKSTORE_CHUNK_SAMPLES, "chunk before the corrupted one is not decoded");
+    CHECK(chunkstore_decode(reader, &reader->records[2], samples) == CHUNKSTORE_CHUNK_SAMPLES, "chunk after the corrupted one is not decoded");
+    chunkstore_unmap(reader);
+
+    // emstoreは壊れたチャンクだけを飛ばす
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -d %s -s C -r 2> /dev/null", emstore, dir);
+    FILE *fp = popen(command, "r");
+    int32_t value;
+    int count = 0, mismatch = 0;
+    while (fread(&value, sizeof(value), 1, fp) == 1) {
+        int i = count < CHUNKSTORE_CHUNK_SAMPLES ? count : count + CHUNKSTORE_CHUNK_SAMPLES;
+        if (value != sample_value(1, i)) {
+            mismatch++;
+        }
+        count++;
+    }
+    pclose(fp);
+    CHECK(count == CAPTURE1 - CHUNKSTORE_CHUNK_SAMPLES && mismatch == 0, "emstore returned %d samples (%d differ) around the corrupted chunk (expected %d)",
+          count, mismatch, CAPTURE1 - CHUNKSTORE_CHUNK_SAMPLES);
+}
+
+// サンプル番号 -> 時刻 (2回の取得を通した番号)
+static int64_t sample_time(int i) {
+    return i < CAPTURE1 ? T0_NS + (int64_t)i * PERIOD_NS : T1_NS + (int64_t)(i - CAPTURE1) * PERIOD_NS;
+}
+
+static int32_t sample_at(int i) {
+    return i < CAPTURE1 ? sample_value(1, i) : sample_value(2, i - CAPTURE1);
+}
+
+// emstore -f from -t to の出力が [from, to) のサンプルと一致するか確かめる
+static void check_range(int64_t from_ns, int64_t to_ns) {
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -d %s -s B -r -f %lld.%09lld -t %lld.%09lld 2> /dev/null", emstore, dir,
+             (long long)(from_ns / 1000000000LL), (long long)(from_ns % 1000000000LL),
+             (long long)(to_ns / 1000000000LL), (long long)(to_ns % 1000000000LL));
+    FILE *fp = popen(command, "r");
+    int32_t value;
+    int i = 0;
+    while (i < CAPTURE1 + CAPTURE2 && sample_time(i) < from_ns) {
+        i++;
+    }
+    int count = 0, mismatch = 0;
+    while (fread(&value, sizeof(value), 1, fp) == 1) {
+        if (i >= CAPTURE1 + CAPTURE2 || sample_time(i) >= to_ns || value != sample_at(i)) {
+            mismatch++;
+        }
+        i++;
+        count++;
+    }
+    pclose(fp);
+    int expected = 0;
+    for (int j = 0; j < CAPTURE1 + CAPTURE2; j++) {
+        if (sample_time(j) >= from_ns && sample_time(j) < to_ns) {
+            expected++;
+        }
+    }
+    CHECK(count == expected && mismatch == 0, "emstore -f %lld -t %lld: %d samples (%d differ), expected %d",
+          (long long)from_ns, (long long)to_ns, count, mismatch, expected);
+}
+
+static void test_boundaries(void) {
+    append_capture("B", 1, T0_NS, CAPTURE1);
+    append_capture("B", 2, T1_NS, CAPTURE2);
+    ChunkStoreReader *reader = chunkstore_map(dir, "B");
+    CHECK(reader != NULL && reader->num_records == 5, "chunkstore_map(B)");
+    if (reader == NULL) {
+        return;
+    }
+
+    // 各チャンクの先頭・末尾・直後の時刻
+    for (uint64_t k = 0; k < reader->num_records; k++) {
+        const ChunkRecord *rec = &reader->records[k];
+        int64_t end_ns = chunkstore_end_ns(rec);
+        CHECK(chunkstore_find(reader, rec->start_ns) == k, "find(start of chunk %llu)", (unsigned long long)k);
+        CHECK(chunkstore_find(reader, end_ns - 1) == k, "find(end of chunk %llu - 1ns)", (unsigned long long)k);
+        CHECK(chunkstore_find(reader, end_ns) == k + 1, "find(end of chunk %llu) = %llu", (unsigned long long)k,
+              (unsigned long long)chunkstore_find(reader, end_ns));
+    }
+    CHECK(chunkstore_find(reader, T0_NS - 1) == 0, "find(before the store)");
+    CHECK(chunkstore_find(reader, T0_NS + 50LL * 1000000000LL) == 4, "find(between the captures)");
+    CHECK(chunkstore_find(reader, T1_NS + 3600LL * 1000000000LL) == 5, "find(after the store)");
+    int64_t boundary = reader->records[1].start_ns;
+    chunkstore_unmap(reader);
+
+    check_range(T0_NS - 1000000000LL, T1_NS + 3600LL * 1000000000LL); // 全体
+    check_range(boundary, boundary + 2LL * CHUNKSTORE_CHUNK_SAMPLES * PERIOD_NS); // チャンク1と2ちょうど
+    check_range(boundary - PERIOD_NS, boundary + PERIOD_NS);          // 境界をまたぐ2サンプル
+    check_range(boundary - 1, boundary);                                // 境界の直前の1ns: 空
+    check_range(boundary, boundary + 1);                                // 境界の先頭のサンプルだけ
+    check_range(T0_NS + 50LL * 1000000000LL, T1_NS + PERIOD_NS);      // 取得の間から2回目の先頭まで
+    check_range(T0_NS + 50LL * 1000000000LL, T1_NS);                  // 取得の間だけ: 空
+}
+
+// 時計が戻った取得は前回の末尾へ詰めて記録し、インデックスは時刻順のままにする
+static void test_clock_step(void) {
+    append_capture("O", 1, T1_NS, CAPTURE2);
+    append_capture("O", 2, T0_NS, 100);
+    ChunkStoreReader *reader = chunkstore_map(dir, "O");
+    CHECK(reader != NULL && reader->num_records == 2, "chunkstore_map(O)");
+    if (reader == NULL || reader->num_records != 2) {
+        chunkstore_unmap(reader);
+        return;
+    }
+    int64_t end_ns = chunkstore_end_ns(&reader->records[0]);
+    CHECK(reader->records[1].start_ns == end_ns, "capture before the previous one starts at %lld (expected %lld)",
+          (long long)reader->records[1].start_ns, (long long)end_ns);
+    CHECK(chunkstore_find(reader, end_ns) == 1, "find(end of the first capture)");
+    chunkstore_unmap(reader);
+    const int captures[] = { 1, 2 };
+    const int lengths[] = { CAPTURE2, 100 };
+    check_decoded("O", captures, lengths, 2);
+}
+
+static void store_file(char *path, size_t size, const char *label, const char *ext) {
+    snprintf(path, size, "%s/%s.%s", dir, label, ext);
+}
+
+static void copy_file(const char *from, const char *to) {
+    char buf[4096];
+    size_t n;
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    CHECK(in != NULL && out != NULL, "copy %s -> %s", from, to);
+    if (in != NULL && out != NULL) {
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+}
+
+// 1チャンクずつの取得 (取得cは T0_NS + c * 10秒) が古い方から捨てられ、残りは最新の取得までの連続した取得で、
+// 書き写したチャンクがすべて展開できるか確かめる
+#define TRIM_INTERVAL_NS (10LL * 1000000000LL)
+static void check_trimmed(const char *label, int last_capture) {
+    ChunkStoreReader *reader = chunkstore_map(dir, label);
+    CHECK(reader != NULL && reader->num_records >= 2, "%s: chunkstore_map", label);
+    if (reader == NULL || reader->num_records < 2) {
+        chunkstore_unmap(reader);
+        return;
+    }
+    int first_capture = (int)((reader->records[0].start_ns - T0_NS) / TRIM_INTERVAL_NS);
+    CHECK(first_capture > 1, "%s: the oldest capture is not dropped", label);
+    CHECK(first_capture + (int)reader->num_records - 1 == last_capture, "%s: captures %d.. in %llu records (expected up to %d)", label,
+          first_capture, (unsigned long long)reader->num_records, last_capture);
+    int32_t samples[CHUNKSTORE_CHUNK_SAMPLES];
+    for (uint64_t k = 0; k < reader->num_records; k++) {
+        const ChunkRecord *rec = &reader->records[k];
+        int capture = first_capture + (int)k;
+        CHECK(rec->start_ns == T0_NS + capture * TRIM_INTERVAL_NS, "%s: record %llu is not capture %d", label, (unsigned long long)k, capture);
+        int n = chunkstore_decode(reader, rec, samples);
+        CHECK(n == CAPTURE2, "%s: record %llu is not decoded after the trim", label, (unsigned long long)k);
+        for (int j = 0; j < n; j++) {
+            if (samples[j] != sample_value(capture, j)) {
+                CHECK(0, "%s: record %llu sample %d differs", label, (unsigned long long)k, j);
+                break;
+            }
+        }
+    }
+    chunkstore_unmap(reader);
+}
+
+// 上限を超えると古いチャンクから捨て、書き写しが途中で終わっても次に開いたときに揃える
+static void test_trim(void) {
+    const int64_t limit = 40 * 1024;
+    int32_t samples[CAPTURE2];
+    int capture;
+    for (capture = 1; capture <= 30; capture++) {
+        for (int i = 0; i < CAPTURE2; i++) {
+            samples[i] = sample_value(capture, i);
+        }
+        ChunkStore *cs = chunkstore_open(dir, "T");
+        CHECK(cs != NULL, "chunkstore_open(T)");
+        if (cs == NULL) {
+            return;
+        }
+        CHECK(chunkstore_append(cs, T0_NS + capture * TRIM_INTERVAL_NS, RATE, samples, CAPTURE2) == 0, "chunkstore_append(T)");
+        CHECK(chunkstore_trim(cs, limit) >= 0, "chunkstore_trim(T)");
+        chunkstore_close(cs);
+        off_t size = file_size("T", "dat") + file_size("T", "idx");
+        CHECK(size <= limit, "T: %lld bytes after capture %d (limit %lld)", (long long)size, capture, (long long)limit);
+    }
+    capture--;
+    check_trimmed("T", capture);
+    check_data_end("T");
+
+    // 書き写しの途中で落ちた: idx.newとdat.newを捨てる
+    char dat_path[512], idx_new[512], dat_new[512], dat_old[512];
+    store_file(dat_path, sizeof(dat_path), "T", "dat");
+    store_file(idx_new, sizeof(idx_new), "T", "idx.new");
+    store_file(dat_new, sizeof(dat_new), "T", "dat.new");
+    store_file(dat_old, sizeof(dat_old), "T", "dat.old");
+    append_garbage("T", "idx.new", 100);
+    append_garbage("T", "dat.new", 1000);
+    capture++;
+    append_capture("T", capture, T0_NS + capture * TRIM_INTERVAL_NS, CAPTURE2);
+    CHECK(access(idx_new, F_OK) < 0 && access(dat_new, F_OK) < 0, "T: files of an interrupted trim are left");
+    check_trimmed("T", capture);
+
+    // idxを入れ替えた後、datを入れ替える前に落ちた: 読み出し側はdat.newを使い、次に開いたときにdatを入れ替える
+    copy_file(dat_path, dat_old);
+    ChunkStore *cs = chunkstore_open(dir, "T");
+    if (cs != NULL) {
+        CHECK(chunkstore_trim(cs, 12 * 1024) > 0, "chunkstore_trim(T) with a smaller limit");
+        chunkstore_close(cs);
+    }
+    CHECK(rename(dat_path, dat_new) == 0 && rename(dat_old, dat_path) == 0, "rename T.dat");
+    check_trimmed("T", capture);
+    capture++;
+    append_capture("T", capture, T0_NS + capture * TRIM_INTERVAL_NS, CAPTURE2);
+    CHECK(access(dat_new, F_OK) < 0, "T: interrupted trim is not completed");
+    check_trimmed("T", capture);
+    check_data_end("T");
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    // emstoreはこのプログラムと同じディレクトリのものを使う
+    const char *slash = strrchr(argv[0], '/');
+    snprintf(emstore, sizeof(emstore), "%.*semstore", slash != NULL ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+
+    snprintf(dir, sizeof(dir), "/tmp/chunkstore_test.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    test_recover();
+    test_crc();
+    test_boundaries();
+    test_clock_step();
+    test_trim();
+
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "Warning: failed to remove %s\n", dir);
+    }
+    printf("chunkstore_test: %s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
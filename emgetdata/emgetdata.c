@@ -15,25 +15,39 @@
 #include <sys/select.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "debug.h"
+#include "livetap.h"
+#include "afe_format.h"
+#include "storage.h"
+#include "chunkstore.h"
+#include "schedule.h"
+#include <libgen.h>
+#include <fnmatch.h>
+#include <limits.h>
 
 #define BUF_SIZE 1024
 #define NUM_BLOCKS 8
-#define NUM_CHANNELS 4
 #define MAX_SENSORS 32
-#define DATA_SIZE 1026
-#define NUM_DATA_PER_PACKET 128 // 128 data per packet
 #define TIMEOUT_SEC 1
 #define TIMEOUT_USEC 500000 // total timeout length: 1500 msec
-#define EPSILON 1.0e-9
-#define SAMPLING_RATE 20000 // Sampling Rate of AFE
-
+#define MIN_DEGRADED_RATE 1000 // ディスク不足時にサンプリングレートを下げる下限
+
+// 自動レンジ (auto_range: true)。値はフルスケールに対する比
+#define AUTO_RANGE_TARGET_PEAK 0.5  // ゲインを選び直す場合に狙うpeak (6dBの余裕を残す)
+#define AUTO_RANGE_CLIP_PEAK 0.9    // これ以上のpeakはクリップの恐れがあるとみなす
+#define AUTO_RANGE_WEAK_RMS 0.01    // これ未満のRMSは弱すぎる (check_wav_effectivenessの既定値と同じ1%)
+#define AUTO_RANGE_SILENT_PEAK 0.001 // これ未満のpeakは無信号とみなしゲインを変えない
+#define AUTO_RANGE_SETTLE_SECOND 0.2 // ゲイン変更後に読み捨てる時間
 // Sensor data structure
 typedef struct {
     char *label;
     char *block;
     char *channel;
     int gain;
+    double cadence;  // capture interval in sec. for the scheduler (0: every run)
+    double duration; // capture length in sec. for the scheduler (0: -t)
+    int priority;    // larger is captured first by the scheduler
 } Sensor;
 
 // Config data structure
@@ -43,6 +57,26 @@ typedef struct {
     Sensor *sensors;
     int num_sensors;
     int sampling_rate;
+    char *afe_format_name;   // packet format of the AFE (see afe_format.c)
+    const AfeFormat *format;
+    char *live_tap;         // shared memory name of the live tap (NULL: disabled)
+    double live_tap_seconds; // ring length of the live tap
+    int disk_budget_mb;     // disk budget for the capture output (0: disabled)
+    int disk_high_watermark; // % of the budget to start eviction
+    int disk_low_watermark;  // % of the budget to evict down to
+    char *storage_index;    // index file of the captures
+    char *rawdata_dir;      // where captures wait for the upload
+    char *noneffective_dir; // where non-effective captures are moved
+    int auto_range;         // re-select the gains from the signal in the ignore window
+    char *output;           // "wav", "store" or "both"
+    int write_wav;
+    int write_store;
+    char *sample_store;     // directory of the chunked sample store
+    double sample_store_mb; // size limit of the store of each sensor (0: unlimited). not counted in disk_budget_mb
+    int schedule;           // capture the sensors by their cadence/duration/priority (see schedule.h)
+    double cycle_budget;    // AFE time in sec. per run for the scheduler (0: unlimited)
+    char *schedule_state;   // last capture time of each sensor
+    char *schedule_log;     // plan-versus-actual log (csv)
 } Config;
 
 // map: block data <-> send data
@@ -77,24 +111,49 @@ const GainData gain_data_map[] = {
     {100, 0x07},
 };
 
+// live tap (config.ymlでlive_tapが指定された場合のみ有効)
+static LiveTap *live_tap = NULL;
+
+// storage manager (config.ymlでdisk_budget_mbが指定された場合のみ有効)
+static StorageManager *storage = NULL;
+
+// 自動レンジでゲインを変更したか (終了時にconfigファイルへ書き戻す)
+static int gains_changed = 0;
+
 void error_handling(char *message, int sock, struct sockaddr_in *serv_addr);
 void read_config(const char *filename, Config *config);
-int getdata(int sock, Config *config, double duration, const char *block_to_record, const char *sensor_to_record);
+int getdata(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const char *block_to_record, const int *selected);
+int auto_range_gains(Config *config, int32_t **data_buffer, int from, int to, const int *row_of_sensor);
+int save_gains(const char *filename, Config *config);
+int select_sensors(Config *config, const char *sensor_patterns, const char *block_list, int *selected);
+int capture_block(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const char *block, const int *selected);
+void run_all_blocks(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const int *selected, int num_selected);
+void run_schedule(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const int *selected, int forced);
+void simulate_schedule(Config *config, double duration, const int *selected, int runs, double interval);
 int send_start_command_of_block(int sock, struct sockaddr_in *serv_addr, Config *config, const char *block);
 int send_stop_command_of_block(int sock, struct sockaddr_in *serv_addr);
 void clear_remaining_buffer(int sock);
 void set_timeout(int sock);
 int check_response(int sock, char *command);
-int16_t** create_data_buffer(double duration, int sampling_rate);
-void free_data_buffer(int16_t** data_buffer);
-void downsample(int16_t *original_data, int16_t *reduced_data, int reduced_length, int original_rate, int new_rate);
-void write_wav_files(SNDFILE **wav_files, int16_t **data_buffer, int data_idx, int sensor_to_record_idx, const char *block_to_record, Config *config, int *channel_of_sensor);
+int receive_samples(int sock, const AfeFormat *format, int32_t **data_buffer, const int *channels, int num_out, int num_samples, int *prev_packet_number, LiveTap *tap);
+int32_t** create_data_buffer(double duration, int sampling_rate, int num_channels);
+void free_data_buffer(int32_t** data_buffer, int num_channels);
+void downsample(int32_t *original_data, int32_t *reduced_data, int reduced_length, int original_rate, int new_rate);
+int32_t** create_reduced_buffer(int32_t **data_buffer, int data_idx, int num_rows, int original_rate, int new_rate, int *reduced_length);
+void write_wav_files(SNDFILE **wav_files, int32_t **data_buffer, int data_idx, Config *config, int *row_of_sensor);
+void write_feature_files(char filenames[][BUF_SIZE * 3], int32_t **data_buffer, int data_idx, int sampling_rate, Config *config, int *row_of_sensor);
+void write_store_files(int32_t **data_buffer, int data_idx, int sampling_rate, int64_t start_ns, Config *config, int *row_of_sensor);
 
 void usage() {
-    fprintf(stderr, "Usage: emgetdata [-f config_file] [-t duration] [-s sensor]\n");
+    fprintf(stderr, "Usage: emgetdata [-f config_file] [-t duration] [-s sensors] [-b blocks] [-n runs [-i interval]]\n");
     fprintf(stderr, "  -f config_file: config file path. default: config.yml\n");
     fprintf(stderr, "  -t duration: duration in sec. default: 10 sec.\n");
-    fprintf(stderr, "  -s sensor: specify a sensor label to record. otherwise, all sensors are recorded.\n");
+    fprintf(stderr, "  -s sensors: comma separated sensor labels or globs to record (e.g. S01,S05,S1*).\n");
+    fprintf(stderr, "  -b blocks: comma separated blocks to record (e.g. A,C).\n");
+    fprintf(stderr, "             if neither -s nor -b is given, all sensors are recorded.\n");
+    fprintf(stderr, "             with schedule: true, the given sensors are recorded regardless of their cadence.\n");
+    fprintf(stderr, "  -n runs: simulate the schedule for the given number of runs without the AFE\n");
+    fprintf(stderr, "  -i interval: interval of the simulated runs in sec. default: 600 sec.\n");
     fprintf(stderr, "  -h: show this help\n");
     fprintf(stderr, "  -v: show version\n");
     fprintf(stderr, "%s\n", COPYRIGHT);
@@ -107,15 +166,21 @@ int main(int argc, char *argv[]) {
     // 引数処理
     // -f config_file: configファイル指定
     // -t: duration in sec.
-    // -s: specify a sensor label to record. otherwise, all sensors are recorded.
+    // -s: sensor labels or globs to record (comma separated).
+    // -b: blocks to record (comma separated). -sも-bも無ければ全センサーを記録する
+    // -n: simulate the schedule for n runs (AFEに接続しない)
+    // -i: interval of the simulated runs in sec.
     // -h: show this help
     // -v: show version
     Config config;
     const char *config_filename = "config.yml";
     int opt;
     double duration = 10.0; // default: 10 sec.
-    const char *sensor_to_record = "";
-    while ((opt = getopt(argc, argv, "f:t:s:hv")) != -1) {
+    const char *sensor_patterns = "";
+    const char *block_list = "";
+    int simulate_runs = 0;
+    double simulate_interval = 600.0; // default: 10 min.
+    while ((opt = getopt(argc, argv, "f:t:s:b:n:i:hv")) != -1) {
         switch (opt) {
             case 'f':
                 config_filename = optarg;
@@ -131,13 +196,36 @@ int main(int argc, char *argv[]) {
                 break;
             case 's':
                 if (optarg != NULL) {
-                    sensor_to_record = optarg;
-                    DEBUG_PRINT("sensor to record: %s\n", sensor_to_record);
+                    sensor_patterns = optarg;
+                    DEBUG_PRINT("sensors to record: %s\n", sensor_patterns);
                 } else {
                     fprintf(stderr, "Error: Sensor argument is missing or invalid.\n");
                     exit(1);
                 }
                 break;
+            case 'b':
+                if (optarg != NULL) {
+                    block_list = optarg;
+                    DEBUG_PRINT("blocks to record: %s\n", block_list);
+                } else {
+                    fprintf(stderr, "Error: Block argument is missing or invalid.\n");
+                    exit(1);
+                }
+                break;
+            case 'n':
+                simulate_runs = atoi(optarg);
+                if (simulate_runs <= 0) {
+                    fprintf(stderr, "Error: the number of runs to simulate must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+                simulate_interval = atof(optarg);
+                if (simulate_interval <= 0) {
+                    fprintf(stderr, "Error: the interval of the simulated runs must be positive.\n");
+                    exit(1);
+                }
+                break;
             case 'h':
                 usage();
                 exit(0);
@@ -151,22 +239,18 @@ int main(int argc, char *argv[]) {
     }
     read_config(config_filename, &config);
 
-    // 引数で特定のセンサーが指定された場合、configファイルに当該センサーの定義があるかどうかを確認する
-    if (strcmp(sensor_to_record, "") != 0) {
-        int found = 0;
-        for (int j = 0; j < config.num_sensors; j++) {
-            if (strcmp(config.sensors[j].label, sensor_to_record) == 0) {
-                found = 1;
-                break;
-            }
-        }
-        if (found == 0) {
-            // センサーが見つからない場合は終了
-            fputs("Sensor not found in config file.", stderr);
-            fputc('\n', stderr);
-            exit(1);
-        }
-    }   
+    // 記録するセンサーを決定する。指定されたセンサーがconfigファイルに無ければ終了
+    int selected[MAX_SENSORS] = { 0 };
+    int num_selected = select_sensors(&config, sensor_patterns, block_list, selected);
+    if (num_selected < 0) {
+        exit(1);
+    }
+
+    // スケジュールのシミュレーション。AFEにも状態ファイルにも触れない
+    if (simulate_runs > 0) {
+        simulate_schedule(&config, duration, selected, simulate_runs, simulate_interval);
+        return 0;
+    }
 
     if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
         error_handling("socket", sock, &serv_addr);
@@ -182,80 +266,350 @@ int main(int argc, char *argv[]) {
     DEBUG_PRINT("AFE IP: %s\n", config.afe_ip);
     DEBUG_PRINT("AFE Port: %d\n", config.afe_port);
 
-    // config.ymlに存在するブロックを特定
+    // live tapの作成。失敗してもデータ取得は継続する
+    if (config.live_tap != NULL && strcmp(config.live_tap, "") != 0) {
+        live_tap = livetap_create(config.live_tap, config.format->num_channels, config.live_tap_seconds, config.format->sampling_rate);
+        if (live_tap == NULL) {
+            fprintf(stderr, "Warning: failed to create live tap [%s]. continue without it.\n", config.live_tap);
+        }
+    }
+
+    // ディスク予算の管理
+    if (config.disk_budget_mb > 0) {
+        storage = storage_open(config.storage_index, (int64_t)config.disk_budget_mb * 1024 * 1024,
+                               config.disk_high_watermark, config.disk_low_watermark,
+                               config.rawdata_dir, config.noneffective_dir);
+        if (storage == NULL) {
+            fprintf(stderr, "Warning: failed to open storage index [%s]. continue without disk budget.\n", config.storage_index);
+        }
+    }
+
+    if (config.schedule) {
+        // スケジューラ: センサー毎の周期・取得時間・優先度に従って、取得が必要なブロックだけを優先度順に取得する
+        int forced = strcmp(sensor_patterns, "") != 0 || strcmp(block_list, "") != 0;
+        run_schedule(sock, &serv_addr, &config, duration, selected, forced);
+    } else {
+        run_all_blocks(sock, &serv_addr, &config, duration, selected, num_selected);
+    }
+
+    // 自動レンジで選んだゲインを次回以降も使えるようにconfigファイルへ書き戻す
+    if (gains_changed) {
+        save_gains(config_filename, &config);
+    }
+
+    storage_close(storage);
+    livetap_close(live_tap);
+    close(sock);
+    return 0;
+}
+
+// 記録するセンサーを含むブロックをA->Hの順に1回ずつ、同じ時間だけ取得する
+void run_all_blocks(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const int *selected, int num_selected) {
+    // 記録するセンサーを含むブロックを特定 (各ブロックは1回だけstartする)
     char used_blocks[NUM_BLOCKS] = {0};
-    for (int i = 0; i < config.num_sensors; i++) {
+    int num_used_blocks = 0;
+    for (int i = 0; i < config->num_sensors; i++) {
+        if (!selected[i]) {
+            continue;
+        }
         for (int j = 0; j < NUM_BLOCKS; j++) {
-            if (strcmp(config.sensors[i].block, block_data_map[j].block) == 0) {
+            if (strcmp(config->sensors[i].block, block_data_map[j].block) == 0) {
+                num_used_blocks += !used_blocks[j];
                 used_blocks[j] = 1;
                 break;
             }
         }
     }
 
+    // センサー毎に起動した場合と比べたオーバーヘッド (start/settle/discard/stop) の削減量を報告するための計測
+    struct timespec run_start, run_end;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+
     // block毎にデータを取得
     for (int block_count = 0; block_count < NUM_BLOCKS; block_count++) {
         if (!used_blocks[block_count]) {
-            continue;  // config.ymlに存在しないブロックはスキップ
+            continue;  // 記録するセンサーが無いブロックはスキップ
         }
+        DEBUG_PRINT("block: %s\n", block_data_map[block_count].block);
+        capture_block(sock, serv_addr, config, duration, block_data_map[block_count].block, selected);
+    } // end of for (int block_count = 0; block_count < NUM_BLOCKS; block_count++)
 
-        // 特定のセンサーのみ記録する場合は、このブロックに当該センサーラベルがあるかチェック
-        if (strcmp(sensor_to_record, "") != 0) {
-            int found = 0;
-            for (int j = 0; j < config.num_sensors; j++) {
-                if ((strcmp(config.sensors[j].block, block_data_map[block_count].block) == 0) && (strcmp(config.sensors[j].label, sensor_to_record)) == 0) {
-                    found = 1;
-                    break;
-                }
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+
+    if (num_used_blocks > 0) {
+        double elapsed = (run_end.tv_sec - run_start.tv_sec) + (run_end.tv_nsec - run_start.tv_nsec) * 1e-9;
+        double overhead_per_block = elapsed / num_used_blocks - duration;
+        double per_sensor_estimate = num_selected * (duration + overhead_per_block);
+        fprintf(stderr, "captured %d sensors in %d blocks: %.1f sec (overhead %.2f sec/block). "
+                "per-sensor invocations would take about %.1f sec (%.1f sec saved)\n",
+                num_selected, num_used_blocks, elapsed, overhead_per_block, per_sensor_estimate, per_sensor_estimate - elapsed);
+    }
+}
+
+static double realtime_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// configのセンサーをスケジューラの入力に変換し、対象のセンサー数を返す。
+// durationを指定していないセンサーは-tの時間、ブロックがblock_data_mapに無いセンサーは対象外
+static int build_schedule_sensors(Config *config, double duration, const int *selected, int forced, ScheduleSensor *sensors) {
+    int num_candidates = 0;
+    for (int i = 0; i < config->num_sensors; i++) {
+        ScheduleSensor *s = &sensors[i];
+        memset(s, 0, sizeof(*s));
+        s->label = config->sensors[i].label;
+        s->block = config->sensors[i].block;
+        s->block_index = -1;
+        for (int j = 0; j < NUM_BLOCKS; j++) {
+            if (strcmp(config->sensors[i].block, block_data_map[j].block) == 0) {
+                s->block_index = j;
+                break;
             }
-            if (found == 0) {
-                continue;
+        }
+        s->cadence = config->sensors[i].cadence;
+        s->duration = config->sensors[i].duration > 0 ? config->sensors[i].duration : duration;
+        s->priority = config->sensors[i].priority;
+        s->candidate = selected[i] && s->block_index >= 0;
+        s->forced = forced && s->candidate;
+        num_candidates += s->candidate;
+    }
+    return num_candidates;
+}
+
+// 状態ファイルの前回取得時刻から計画を立ててその順に取得し、計画と実績をstderrとschedule_log (csv) に記録する。
+// forced (-s/-bの指定あり) の場合は指定されたセンサーを周期に関係なく取得する
+void run_schedule(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const int *selected, int forced) {
+    ScheduleSensor sensors[MAX_SENSORS];
+    ScheduleState state;
+    SchedulePlan plan;
+
+    build_schedule_sensors(config, duration, selected, forced, sensors);
+    schedule_load_state(config->schedule_state, &state);
+    double now = realtime_now();
+    schedule_plan(sensors, config->num_sensors, &state, now, config->cycle_budget, &plan);
+    schedule_print_plan(stderr, &plan, sensors, config->num_sensors);
+
+    // ログが書けなくても取得は続ける
+    FILE *log = fopen(config->schedule_log, "a");
+    if (log == NULL) {
+        fprintf(stderr, "Warning: failed to open schedule log [%s]: %s\n", config->schedule_log, strerror(errno));
+    } else if (ftell(log) == 0) {
+        fprintf(log, "run,block,sensors,window,planned_start,planned_sec,actual_start,actual_sec,retries\n");
+    }
+    time_t t = (time_t)now;
+    struct tm tm = *localtime(&t);
+    char run_time[32];
+    strftime(run_time, sizeof(run_time), "%Y%m%d%H%M%S", &tm);
+
+    int num_captured = 0;
+    double run_start = monotonic_now();
+    for (int k = 0; k < plan.num_entries; k++) {
+        ScheduleEntry *e = &plan.entries[k];
+        double captured_at = realtime_now();
+        double block_start = monotonic_now() - run_start;
+        int retries = capture_block(sock, serv_addr, config, e->window, e->block, e->sensors);
+        double actual = monotonic_now() - run_start - block_start;
+        fprintf(stderr, "actual: block %s at +%.1f sec took %.1f sec (planned +%.1f sec, %.1f sec)%s\n",
+                e->block, block_start, actual, e->start, e->cost, retries > 0 ? " with retries" : "");
+
+        char labels[BUF_SIZE] = "";
+        for (int i = 0; i < config->num_sensors; i++) {
+            if (e->sensors[i]) {
+                schedule_set_capture(&state, config->sensors[i].label, captured_at);
+                snprintf(labels + strlen(labels), sizeof(labels) - strlen(labels), "%s%s", labels[0] ? " " : "", config->sensors[i].label);
+                num_captured++;
             }
-        }   
-        DEBUG_PRINT("block: %s\n", block_data_map[block_count].block);
+        }
+        if (log != NULL) {
+            fprintf(log, "%s,%s,%s,%.1f,%.3f,%.3f,%.3f,%.3f,%d\n", run_time, e->block, labels, e->window, e->start, e->cost, block_start, actual, retries);
+            fflush(log);
+        }
+        // リトライした場合は次の計画の見積もりに使わない
+        if (retries == 0) {
+            schedule_update_overhead(&state, actual - e->window);
+        }
+    }
+    if (log != NULL) {
+        fclose(log);
+    }
 
-        int retry_count_getdata = 0;
-        int retry_limit = 3;
-        retry:
+    fprintf(stderr, "captured %d sensors in %d blocks: %.1f sec of AFE time (planned %.1f sec)\n",
+            num_captured, plan.num_entries, monotonic_now() - run_start, plan.total);
+    // 周期の許容幅に使う実行間隔は定期実行のものだけにする
+    if (!forced) {
+        state.last_run = now;
+    }
+    schedule_save_state(config->schedule_state, &state);
+}
 
-        // 計測開始コマンドの送信
-        if (send_start_command_of_block(sock, &serv_addr, &config, block_data_map[block_count].block) < 0) {
-            fprintf(stderr, "Error: send_start_command_of_block() failed.\n");
-            exit(1);
+// -n: 状態ファイルの現在の内容から、interval秒毎にruns回実行した場合の計画をAFEなしで評価する。
+// 各ブロックは計画通りの時間 (オーバーヘッドは状態ファイルの実測値) で終わるとみなし、状態ファイルは更新しない。
+// -s/-bは対象のセンサーを絞るだけで、周期は無視しない
+void simulate_schedule(Config *config, double duration, const int *selected, int runs, double interval) {
+    ScheduleSensor sensors[MAX_SENSORS];
+    ScheduleState state;
+    SchedulePlan plan;
+    double last[MAX_SENSORS];
+    double max_gap[MAX_SENSORS] = { 0 };
+    int captures[MAX_SENSORS] = { 0 };
+    int deferred[MAX_SENSORS] = { 0 };
+    int used_blocks[NUM_BLOCKS] = { 0 };
+    int num_used_blocks = 0;
+
+    build_schedule_sensors(config, duration, selected, 0, sensors);
+    schedule_load_state(config->schedule_state, &state);
+    for (int i = 0; i < config->num_sensors; i++) {
+        last[i] = schedule_last_capture(&state, sensors[i].label);
+        if (sensors[i].candidate && !used_blocks[sensors[i].block_index]) {
+            used_blocks[sensors[i].block_index] = 1;
+            num_used_blocks++;
         }
-        usleep(1000000);
+    }
 
-        // データ取得
-        DEBUG_PRINT("Start recording for block %s...\n", block_data_map[block_count].block);
-        if (getdata(sock, &config, duration, block_data_map[block_count].block, sensor_to_record) < 0) {
-            // getdata()が失敗した場合は、stopコマンドを送信してからリトライする。ただし、3回まで。
-            retry_count_getdata++;
-            if (retry_count_getdata > retry_limit) {
-                fprintf(stderr, "Error: getdata() failed. Retry count exceeded.\n");
-                exit(1);
+    double start = realtime_now();
+    double total = 0.0;
+    for (int r = 0; r < runs; r++) {
+        double now = start + r * interval;
+        schedule_plan(sensors, config->num_sensors, &state, now, config->cycle_budget, &plan);
+        printf("run %d (+%.0f sec)\n", r + 1, now - start);
+        schedule_print_plan(stdout, &plan, sensors, config->num_sensors);
+        for (int k = 0; k < plan.num_entries; k++) {
+            ScheduleEntry *e = &plan.entries[k];
+            for (int i = 0; i < config->num_sensors; i++) {
+                if (!e->sensors[i]) {
+                    continue;
+                }
+                double captured_at = now + e->start;
+                if (last[i] >= 0 && captured_at - last[i] > max_gap[i]) {
+                    max_gap[i] = captured_at - last[i];
+                }
+                last[i] = captured_at;
+                captures[i]++;
+                schedule_set_capture(&state, sensors[i].label, captured_at);
             }
-            fprintf(stderr, "Error: getdata() failed. Retry...\n");
+        }
+        for (int i = 0; i < config->num_sensors; i++) {
+            deferred[i] += plan.deferred[i];
+        }
+        state.last_run = now;
+        total += plan.total;
+    }
 
-            // 計測終了コマンドの送信
-            if (send_stop_command_of_block(sock, &serv_addr) < 0) {
-                fprintf(stderr, "Error: send_stop_command_of_block() failed.\n");
-                exit(1);
-            }
+    // 周期 (毎回取得の場合は実行間隔) より1間隔以上空いたセンサーを遅れとして示す
+    double end = start + (runs - 1) * interval;
+    printf("\nsensor  block  cadence  duration  priority  captures  max_gap  deferred\n");
+    for (int i = 0; i < config->num_sensors; i++) {
+        if (!sensors[i].candidate) {
+            continue;
+        }
+        double gap = max_gap[i];
+        if (last[i] < 0 || end - last[i] > gap) {
+            gap = last[i] < 0 ? end - start : end - last[i];
+        }
+        double expected = sensors[i].cadence > interval ? sensors[i].cadence : interval;
+        printf("%-7s %-6s %7.0f  %8.1f  %8d  %8d  %7.0f  %8d%s\n", sensors[i].label, sensors[i].block, sensors[i].cadence,
+               sensors[i].duration, sensors[i].priority, captures[i], gap, deferred[i],
+               captures[i] == 0 || gap > expected + interval ? "  late" : "");
+    }
+    double fixed_total = runs * num_used_blocks * (duration + state.overhead);
+    printf("\nAFE time: %.1f sec in %d runs (%.1f sec/run). capturing every block for %.1f sec in each run: %.1f sec (%.1f sec/run)\n",
+           total, runs, total / runs, duration, fixed_total, fixed_total / runs);
+}
+
+// ブロックを起動してduration秒取得し、停止する。getdata()が失敗した場合は停止してやり直す (3回まで)。
+// やり直した回数を返す
+int capture_block(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const char *block, const int *selected) {
+    int retry_count_getdata = 0;
+    int retry_limit = 3;
+    retry:
 
-            goto retry;
+    // 計測開始コマンドの送信
+    if (send_start_command_of_block(sock, serv_addr, config, block) < 0) {
+        fprintf(stderr, "Error: send_start_command_of_block() failed.\n");
+        exit(1);
+    }
+    usleep(1000000);
+
+    // データ取得
+    DEBUG_PRINT("Start recording for block %s...\n", block);
+    if (getdata(sock, serv_addr, config, duration, block, selected) < 0) {
+        // getdata()が失敗した場合は、stopコマンドを送信してからリトライする。ただし、3回まで。
+        retry_count_getdata++;
+        if (retry_count_getdata > retry_limit) {
+            fprintf(stderr, "Error: getdata() failed. Retry count exceeded.\n");
+            exit(1);
         }
-        DEBUG_PRINT("done\n");
+        fprintf(stderr, "Error: getdata() failed. Retry...\n");
 
         // 計測終了コマンドの送信
-        if (send_stop_command_of_block(sock, &serv_addr) < 0) {
+        if (send_stop_command_of_block(sock, serv_addr) < 0) {
             fprintf(stderr, "Error: send_stop_command_of_block() failed.\n");
             exit(1);
         }
-        usleep(1000000);
-    } // end of for (int block_count = 0; block_count < NUM_BLOCKS; block_count++)
 
-    close(sock);
-    return 0;
+        goto retry;
+    }
+    DEBUG_PRINT("done\n");
+
+    // 計測終了コマンドの送信
+    if (send_stop_command_of_block(sock, serv_addr) < 0) {
+        fprintf(stderr, "Error: send_stop_command_of_block() failed.\n");
+        exit(1);
+    }
+    usleep(1000000);
+    return retry_count_getdata;
+}
+
+// -s (ラベルまたはglobのカンマ区切り) と -b (ブロックのカンマ区切り) から記録するセンサーを決め、その数を返す。
+// どちらも空なら全センサー。どのセンサーにも一致しない指定があれば-1を返す。
+int select_sensors(Config *config, const char *sensor_patterns, const char *block_list, int *selected) {
+    char buf[BUF_SIZE];
+    int num_selected = 0;
+
+    if (config->num_sensors > MAX_SENSORS) {
+        fprintf(stderr, "Error: too many sensors in config file (max %d).\n", MAX_SENSORS);
+        return -1;
+    }
+
+    if (strcmp(sensor_patterns, "") == 0 && strcmp(block_list, "") == 0) {
+        for (int i = 0; i < config->num_sensors; i++) {
+            selected[i] = 1;
+        }
+        return config->num_sensors;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        snprintf(buf, sizeof(buf), "%s", pass == 0 ? sensor_patterns : block_list);
+        for (char *token = strtok(buf, ","); token != NULL; token = strtok(NULL, ",")) {
+            int found = 0;
+            for (int i = 0; i < config->num_sensors; i++) {
+                int match = pass == 0 ? fnmatch(token, config->sensors[i].label, 0) == 0
+                                      : strcmp(token, config->sensors[i].block) == 0;
+                if (match) {
+                    found = 1;
+                    selected[i] = 1;
+                }
+            }
+            if (found == 0) {
+                // センサーが見つからない場合は終了
+                fprintf(stderr, "%s not found in config file: %s\n", pass == 0 ? "Sensor" : "Block", token);
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < config->num_sensors; i++) {
+        num_selected += selected[i];
+    }
+    return num_selected;
 }
 
 void error_handling(char *message, int sock, struct sockaddr_in *serv_addr) {
@@ -292,6 +646,23 @@ void read_config(const char *filename, Config *config) {
     // 初期化
     config->sensors = NULL;
     config->num_sensors = 0;
+    config->afe_format_name = strdup(AFE_DEFAULT_FORMAT);
+    config->live_tap = NULL;
+    config->live_tap_seconds = 10.0;
+    config->disk_budget_mb = 0;
+    config->disk_high_watermark = 90;
+    config->disk_low_watermark = 75;
+    config->storage_index = NULL;
+    config->rawdata_dir = NULL;
+    config->noneffective_dir = NULL;
+    config->auto_range = 0;
+    config->output = strdup("wav");
+    config->sample_store = NULL;
+    config->sample_store_mb = 0.0;
+    config->schedule = 0;
+    config->cycle_budget = 0.0;
+    config->schedule_state = NULL;
+    config->schedule_log = NULL;
 
     while (!done) {
         if (!yaml_parser_parse(&parser, &event)) {
@@ -314,12 +685,87 @@ void read_config(const char *filename, Config *config) {
                 yaml_event_delete(&event);
                 yaml_parser_parse(&parser, &event);
                 config->sampling_rate = atoi((char *)event.data.scalar.value);
+            } else if (strcmp(key, "afe_format") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                free(config->afe_format_name);
+                config->afe_format_name = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "live_tap") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->live_tap = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "live_tap_seconds") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->live_tap_seconds = atof((char *)event.data.scalar.value);
+            } else if (strcmp(key, "disk_budget_mb") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->disk_budget_mb = atoi((char *)event.data.scalar.value);
+            } else if (strcmp(key, "disk_high_watermark") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->disk_high_watermark = atoi((char *)event.data.scalar.value);
+            } else if (strcmp(key, "disk_low_watermark") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->disk_low_watermark = atoi((char *)event.data.scalar.value);
+            } else if (strcmp(key, "storage_index") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->storage_index = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "rawdata_dir") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->rawdata_dir = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "noneffective_dir") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->noneffective_dir = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "output") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                free(config->output);
+                config->output = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "sample_store") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->sample_store = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "sample_store_mb") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->sample_store_mb = atof((char *)event.data.scalar.value);
+            } else if (strcmp(key, "auto_range") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                char *value = (char *)event.data.scalar.value;
+                config->auto_range = strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+            } else if (strcmp(key, "schedule") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                char *value = (char *)event.data.scalar.value;
+                config->schedule = strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0;
+            } else if (strcmp(key, "cycle_budget") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->cycle_budget = atof((char *)event.data.scalar.value);
+            } else if (strcmp(key, "schedule_state") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->schedule_state = strdup((char *)event.data.scalar.value);
+            } else if (strcmp(key, "schedule_log") == 0) {
+                yaml_event_delete(&event);
+                yaml_parser_parse(&parser, &event);
+                config->schedule_log = strdup((char *)event.data.scalar.value);
             } else if (strcmp(key, "sensors") == 0) {
                 seq_level++;
             } else if (seq_level > 0) {
+                // labelで新しいセンサーを始め、以降のキーはそのセンサーに入れる (キーの順序は問わない)
                 if (strcmp(key, "label") == 0) {
+                    sensor_index = config->num_sensors;
                     config->num_sensors++;
                     config->sensors = realloc(config->sensors, config->num_sensors * sizeof(Sensor));
+                    memset(&config->sensors[sensor_index], 0, sizeof(Sensor));
                     yaml_event_delete(&event);
                     yaml_parser_parse(&parser, &event);
                     config->sensors[sensor_index].label = strdup((char *)event.data.scalar.value);
@@ -335,7 +781,18 @@ void read_config(const char *filename, Config *config) {
                     yaml_event_delete(&event);
                     yaml_parser_parse(&parser, &event);
                     config->sensors[sensor_index].gain = atoi((char *)event.data.scalar.value);
-                    sensor_index++;
+                } else if (strcmp(key, "cadence") == 0) {
+                    yaml_event_delete(&event);
+                    yaml_parser_parse(&parser, &event);
+                    config->sensors[sensor_index].cadence = atof((char *)event.data.scalar.value);
+                } else if (strcmp(key, "duration") == 0) {
+                    yaml_event_delete(&event);
+                    yaml_parser_parse(&parser, &event);
+                    config->sensors[sensor_index].duration = atof((char *)event.data.scalar.value);
+                } else if (strcmp(key, "priority") == 0) {
+                    yaml_event_delete(&event);
+                    yaml_parser_parse(&parser, &event);
+                    config->sensors[sensor_index].priority = atoi((char *)event.data.scalar.value);
                 }
             }
         } else if (event.type == YAML_SEQUENCE_END_EVENT) {
@@ -350,27 +807,101 @@ void read_config(const char *filename, Config *config) {
     yaml_parser_delete(&parser);
     fclose(file);
 
+    config->format = afe_format_find(config->afe_format_name);
+    if (config->format == NULL) {
+        fprintf(stderr, "Error: unknown afe_format [%s]. available:", config->afe_format_name);
+        for (int i = 0; i < num_afe_formats; i++) {
+            fprintf(stderr, " %s", afe_formats[i].name);
+        }
+        fputc('\n', stderr);
+        exit(1);
+    }
+    if (config->sampling_rate <= 0 || config->sampling_rate > config->format->sampling_rate) {
+        fprintf(stderr, "Error: sampling_rate must be in 1..%d Hz for afe_format [%s]\n", config->format->sampling_rate, config->format->name);
+        exit(1);
+    }
+
+    // センサーはブロック内の順番でAFEのチャンネルに対応するので、チャンネル数を超えたセンサーは取得できない
+    for (int i = 0; i < config->num_sensors; i++) {
+        int position = 0;
+        for (int j = 0; j < i; j++) {
+            if (strcmp(config->sensors[j].block, config->sensors[i].block) == 0) {
+                position++;
+            }
+        }
+        if (position >= config->format->num_channels) {
+            fprintf(stderr, "Error: sensor [%s] is the %dth sensor of block %s, but afe_format [%s] has only %d channels\n",
+                    config->sensors[i].label, position + 1, config->sensors[i].block, config->format->name, config->format->num_channels);
+            exit(1);
+        }
+    }
+
+    config->write_wav = strcmp(config->output, "wav") == 0 || strcmp(config->output, "both") == 0;
+    config->write_store = strcmp(config->output, "store") == 0 || strcmp(config->output, "both") == 0;
+    if (!config->write_wav && !config->write_store) {
+        fprintf(stderr, "Error: unknown output [%s]. available: wav store both\n", config->output);
+        exit(1);
+    }
+
+    // storage関連のパスは省略時はconfigファイルのディレクトリ (batch.shのWORK_DIR) を基準にする
+    char config_path[PATH_MAX];
+    if (realpath(filename, config_path) == NULL) {
+        snprintf(config_path, sizeof(config_path), "%s", filename);
+    }
+    char *config_dir = dirname(config_path);
+    char path[PATH_MAX + 32];
+    if (config->storage_index == NULL) {
+        snprintf(path, sizeof(path), "%s/capture.idx", config_dir);
+        config->storage_index = strdup(path);
+    }
+    if (config->rawdata_dir == NULL) {
+        snprintf(path, sizeof(path), "%s/rawdata", config_dir);
+        config->rawdata_dir = strdup(path);
+    }
+    if (config->noneffective_dir == NULL) {
+        snprintf(path, sizeof(path), "%s/rawdata.non-effective", config_dir);
+        config->noneffective_dir = strdup(path);
+    }
+    if (config->sample_store == NULL) {
+        snprintf(path, sizeof(path), "%s/store", config_dir);
+        config->sample_store = strdup(path);
+    }
+    if (config->schedule_state == NULL) {
+        snprintf(path, sizeof(path), "%s/schedule.state", config_dir);
+        config->schedule_state = strdup(path);
+    }
+    if (config->schedule_log == NULL) {
+        snprintf(path, sizeof(path), "%s/schedule.csv", config_dir);
+        config->schedule_log = strdup(path);
+    }
+
     // デバッグ出力
     DEBUG_PRINT("Config loaded:\n");
     DEBUG_PRINT("AFE IP: %s\n", config->afe_ip);
     DEBUG_PRINT("AFE Port: %d\n", config->afe_port);
     DEBUG_PRINT("Sampling Rate: %d\n", config->sampling_rate);
+    DEBUG_PRINT("AFE Format: %s (%d ch, %d bit, %d bytes/packet)\n", config->format->name, config->format->num_channels, config->format->bytes_per_sample * 8, config->format->packet_size);
+    DEBUG_PRINT("Live Tap: %s (%.1f sec)\n", config->live_tap ? config->live_tap : "disabled", config->live_tap_seconds);
+    DEBUG_PRINT("Disk Budget: %d MB (high %d%%, low %d%%), index: %s\n", config->disk_budget_mb, config->disk_high_watermark, config->disk_low_watermark, config->storage_index);
+    DEBUG_PRINT("Output: %s (sample store: %s, %.1f MB per sensor)\n", config->output, config->sample_store, config->sample_store_mb);
+    DEBUG_PRINT("Schedule: %s (cycle budget %.1f sec, state: %s, log: %s)\n", config->schedule ? "enabled" : "disabled", config->cycle_budget, config->schedule_state, config->schedule_log);
     DEBUG_PRINT("Number of Sensors: %d\n", config->num_sensors);
     DEBUG_PRINT("Sensors:\n");
     for (int i = 0; i < config->num_sensors; i++) {
-        DEBUG_PRINT("  Sensor %d: label=%s, block=%s, channel=%s, gain=%d\n",
+        DEBUG_PRINT("  Sensor %d: label=%s, block=%s, channel=%s, gain=%d, cadence=%.0f, duration=%.1f, priority=%d\n",
             i,
             config->sensors[i].label,
             config->sensors[i].block,
             config->sensors[i].channel,
-            config->sensors[i].gain);
+            config->sensors[i].gain,
+            config->sensors[i].cadence,
+            config->sensors[i].duration,
+            config->sensors[i].priority);
     }
 }
 
-int getdata(int sock, Config *config, double duration, const char *block_to_record, const char *sensor_to_record) {
-    uint8_t recv_buf[DATA_SIZE];
-    int recv_len;
-    double data_period = 1.0 / SAMPLING_RATE;
+int getdata(int sock, struct sockaddr_in *serv_addr, Config *config, double duration, const char *block_to_record, const int *selected) {
+    const AfeFormat *format = config->format;
 
     time_t t = time(NULL);
     struct tm tm = *localtime(&t);
@@ -379,247 +910,461 @@ int getdata(int sock, Config *config, double duration, const char *block_to_reco
     gethostname(host_name, BUF_SIZE);
     size_t host_name_len = strlen(host_name);
 
-    // set filesuffix from current time
-    char filesuffix[BUF_SIZE];
-    snprintf(filesuffix, sizeof(filesuffix), "%d%02d%02d%02d%02d%02d.wav", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-    size_t filesuffix_len = strlen(filesuffix);
+    // set timestamp from current time
+    char timestamp[BUF_SIZE];
+    snprintf(timestamp, sizeof(timestamp), "%d%02d%02d%02d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    size_t filesuffix_len = strlen(timestamp) + strlen(".features.csv");
+
+    // sensor番号とblockにおけるchannel番号との対応を格納する配列を生成
+    int channel_of_sensor[MAX_SENSORS] = { -1 };
+    int channel_idx = 0; // 0, 1, 2, 3
+
+    // 記録するセンサーを決め、そのチャンネルだけをデコードする。
+    // row_of_sensor[i]: センサーiのデータが入るdata_bufferの行, decode_channels[row]: その行のAFEチャンネル
+    int to_record[MAX_SENSORS] = { 0 };
+    int row_of_sensor[MAX_SENSORS];
+    int decode_channels[AFE_MAX_CHANNELS];
+    int num_rows = 0;
+    int num_files = 0;
+    for (int i = 0; i < config->num_sensors; i++) {
+        row_of_sensor[i] = -1;
+        if (strcmp(config->sensors[i].block, block_to_record) == 0) {
+            channel_of_sensor[i] = channel_idx;
+            channel_idx++;
+            if (selected[i] && channel_of_sensor[i] < format->num_channels) {
+                to_record[i] = 1;
+                row_of_sensor[i] = num_rows;
+                decode_channels[num_rows] = channel_of_sensor[i];
+                num_rows++;
+                num_files++;
+            }
+        }
+    }
+
+    // WAVファイルのディスク予算の確認。足りない場合は古いデータを解放し、それでも足りなければ
+    // サンプリングレートを下げ、最後は特徴量のみの出力に切り替える (取得自体は失敗させない)。
+    // サンプルストアはsample_store_mbで別に容量を制限するので、予算には数えず、常に設定のレートで書き込む
+    int output_rate = config->sampling_rate;
+    int features_only = 0;
+    if (storage != NULL && config->write_wav) {
+        while (1) {
+            int64_t bytes = num_files * ((int64_t)(duration * output_rate) * format->bytes_per_sample + 44);
+            if (storage_reserve(storage, bytes) == 0) {
+                break;
+            }
+            if (output_rate / 2 >= MIN_DEGRADED_RATE) {
+                output_rate /= 2;
+                fprintf(stderr, "Warning: disk budget exceeded. reducing sampling rate to %d Hz\n", output_rate);
+            } else {
+                features_only = 1;
+                fprintf(stderr, "Warning: disk budget exceeded. writing features only\n");
+                break;
+            }
+        }
+    }
 
     SF_INFO sfinfo;
-    sfinfo.samplerate = config->sampling_rate;
+    sfinfo.samplerate = output_rate;
     sfinfo.channels = 1;
-    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+    sfinfo.format = SF_FORMAT_WAV | format->sf_format;
 
     // Create and write headers for WAV files
     SNDFILE *wav_files[MAX_SENSORS] = { NULL };
+    int64_t storage_records[MAX_SENSORS];
 
     // filenameを格納する配列を生成
     char filenames[MAX_SENSORS][BUF_SIZE * 3] = { "" };
 
-    // sensor番号とblockにおけるchannel番号との対応を格納する配列を生成
-    int channel_of_sensor[MAX_SENSORS] = { -1 };
-    int channel_idx = 0; // 0, 1, 2, 3
-
-    int sensor_to_record_idx = -1;
     for (int i = 0; i < config->num_sensors; i++) {
+        storage_records[i] = -1;
+        if (!to_record[i]) {
+            continue;
+        }
         size_t label_len = strlen(config->sensors[i].label);
-        if (strcmp(config->sensors[i].block, block_to_record) == 0) {
-            channel_of_sensor[i] = channel_idx;
-            channel_idx++;
-            // sensor_to_recordが指定されている場合は、そのセンサーのみwavファイルを作成する
-            if (strcmp(sensor_to_record, "") != 0) {
-                if (strcmp(config->sensors[i].label, sensor_to_record) == 0) {
-                    sensor_to_record_idx = i;
-                    if (host_name_len + label_len + filesuffix_len + 3 < sizeof(filenames[i])) {
-                        snprintf(filenames[i], sizeof(filenames[i]), "%s_%s_%s", host_name, config->sensors[i].label, filesuffix);
-                    } else {
-                        fprintf(stderr, "Error: filename is too long\n");
-                        exit(1);
-                    }
-
-                    fprintf(stderr, "creating wav file [%s] for the sensor [%s]\n", filenames[i], config->sensors[i].label);
-                    wav_files[i] = sf_open(filenames[i], SFM_WRITE, &sfinfo);
-                    if (!wav_files[i]) {
-                        fprintf(stderr, "Error: %s\n", sf_strerror(NULL));
-                        exit(1);
-                    }
-                    break;
-                }
-            } else { // record all sensors
-                if (host_name_len + label_len + filesuffix_len + 3 < sizeof(filenames[i])) {
-                    snprintf(filenames[i], sizeof(filenames[i]), "%s_%s_%s", host_name, config->sensors[i].label, filesuffix);
-                } else {
-                    fprintf(stderr, "Error: filename is too long: ");
-                    fprintf(stderr, "%s_%s_%s", host_name, config->sensors[i].label, filesuffix);
-                    exit(1);
-                }
-                fprintf(stderr, "creating wav file [%s] for the sensor [%s]\n", filenames[i], config->sensors[i].label);
-                wav_files[i] = sf_open(filenames[i], SFM_WRITE, &sfinfo);
-                if (!wav_files[i]) {
-                    fprintf(stderr, "Error: %s\n", sf_strerror(NULL));
-                    exit(1);
-                }
+        if (host_name_len + label_len + filesuffix_len + 3 < sizeof(filenames[i])) {
+            snprintf(filenames[i], sizeof(filenames[i]), "%s_%s_%s.%s", host_name, config->sensors[i].label, timestamp, features_only ? "features.csv" : "wav");
+        } else {
+            fprintf(stderr, "Error: filename is too long: ");
+            fprintf(stderr, "%s_%s_%s", host_name, config->sensors[i].label, timestamp);
+            exit(1);
+        }
+        if (features_only || !config->write_wav) {
+            // 特徴量ファイルはデータ受信後に作成するが、WAVファイルと同じく先に登録しておく。ストアのみの場合はWAVファイルを作らない
+            if (features_only && storage != NULL) {
+                storage_records[i] = storage_begin(storage, filenames[i]);
             }
+            continue;
+        }
+        fprintf(stderr, "creating wav file [%s] for the sensor [%s]\n", filenames[i], config->sensors[i].label);
+        wav_files[i] = sf_open(filenames[i], SFM_WRITE, &sfinfo);
+        if (!wav_files[i]) {
+            fprintf(stderr, "Error: %s\n", sf_strerror(NULL));
+            exit(1);
+        }
+        if (storage != NULL) {
+            storage_records[i] = storage_begin(storage, filenames[i]);
         }
     }
 
-    if (strcmp(sensor_to_record, "") != 0 && sensor_to_record_idx == -1) {
-        fprintf(stderr, "Error: Sensor label '%s' not found in the configuration.\n", sensor_to_record);
-        exit(1);
+    // live tapのchannel->labelの対応をこのブロックのものに切り替える
+    // (記録するチャンネルだけがデコードされるので、タップのチャンネルはdata_bufferの行に対応する)
+    if (live_tap != NULL) {
+        const char *tap_labels[AFE_MAX_CHANNELS] = { NULL };
+        for (int i = 0; i < config->num_sensors; i++) {
+            if (row_of_sensor[i] >= 0) {
+                tap_labels[row_of_sensor[i]] = config->sensors[i].label;
+            }
+        }
+        livetap_set_layout(live_tap, format->sampling_rate, block_to_record, tap_labels);
     }
 
     // n秒間の空データ取得
     double ignore_second = 1.0;
-    double data_duration = 0.0;
-    int data_idx = 0;
-    int packet_number = 0;
-    int prev_packet_number = 0;
+    // 起動後の待ち時間の間に溜まったパケット (受信バッファから溢れた分は欠けている) を捨て、
+    // 連番のチェックは次に届くパケットから始める
+    clear_remaining_buffer(sock);
+    int prev_packet_number = -1;
+    int retval;
 
-    // データ受信用のdata_buffer[NUM_CHANNEL][配列を初期化
-    int16_t **dummy_data_buffer = create_data_buffer(ignore_second, SAMPLING_RATE); // AFEのサンプリングレートは20kHz固定なので、まずはそれを受信して、後でconfig->sampling_rateへdownsampleする
+    // データ受信用のdata_buffer[channel][sample]を初期化
+    int32_t **dummy_data_buffer = create_data_buffer(ignore_second, format->sampling_rate, num_rows); // AFEのサンプリングレートで受信して、後でconfig->sampling_rateへdownsampleする
 
     // Ignore data for the first n second
-    data_duration = 0.0;
     DEBUG_PRINT("start discarding\n");
-    while (data_duration < ignore_second) {
-        recv_len = recvfrom(sock, recv_buf, DATA_SIZE, 0, NULL, NULL);
-        if (recv_len < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Timeout occurred, continue with next iteration
-                printf("Timeout, no data received\n");
+    int ignore_samples = (int)(ignore_second * format->sampling_rate);
+    retval = receive_samples(sock, format, dummy_data_buffer, decode_channels, num_rows, ignore_samples, &prev_packet_number, NULL);
+
+    // 自動レンジ: 読み捨てたデータの後半 (起動直後の過渡応答を除く) でゲインを選び直し、
+    // 変更があった場合だけブロックを起動し直して短い時間を読み捨てる
+    if (retval == 0 && config->auto_range && auto_range_gains(config, dummy_data_buffer, ignore_samples / 2, ignore_samples, row_of_sensor)) {
+        if (send_stop_command_of_block(sock, serv_addr) < 0 || send_start_command_of_block(sock, serv_addr, config, block_to_record) < 0) {
+            fprintf(stderr, "Error: failed to restart block %s with the new gains.\n", block_to_record);
+            retval = -1;
+        } else {
+            prev_packet_number = -1;
+            retval = receive_samples(sock, format, dummy_data_buffer, decode_channels, num_rows, (int)(AUTO_RANGE_SETTLE_SECOND * format->sampling_rate), &prev_packet_number, NULL);
+        }
+    }
+    free_data_buffer(dummy_data_buffer, num_rows);
 
-                // close & remove files
-                if (sensor_to_record_idx != -1) {
-                    sf_close(wav_files[sensor_to_record_idx]);
-                    remove(filenames[sensor_to_record_idx]);
-                } else {
-                    for (int i = 0; i < config->num_sensors; i++) {
-                        if (strcmp(config->sensors[i].block, block_to_record) == 0) {
-                            sf_close(wav_files[i]);
-                            remove(filenames[i]);
-                        }
-                    }
-                }
-                return -1; // -1で返すことによって、呼び出し位置(main関数内)でretryする
-            } else {
-                perror("recvfrom");
-                exit(1);
+    // データ受信
+    int data_idx = (int)(duration * format->sampling_rate);
+    int32_t **data_buffer = NULL;
+    if (retval == 0) {
+        data_buffer = create_data_buffer(duration, format->sampling_rate, num_rows);
+        DEBUG_PRINT("start recording\n");
+        retval = receive_samples(sock, format, data_buffer, decode_channels, num_rows, data_idx, &prev_packet_number, live_tap);
+    }
+    // 受信し終えた時点の時刻から最初のサンプルの時刻を求める (ストアのインデックス用)
+    struct timespec end_time;
+    clock_gettime(CLOCK_REALTIME, &end_time);
+    int64_t start_ns = end_time.tv_sec * 1000000000LL + end_time.tv_nsec - (int64_t)((double)data_idx * 1e9 / format->sampling_rate);
+    if (retval < 0) {
+        // close & remove files
+        for (int i = 0; i < config->num_sensors; i++) {
+            if (wav_files[i] != NULL) {
+                sf_close(wav_files[i]);
+                remove(filenames[i]);
+            }
+            if (storage != NULL) {
+                storage_abort(storage, storage_records[i]);
             }
         }
-        if (recv_len < DATA_SIZE) {
-            fprintf(stderr, "Error: recvfrom() returned %d\n", recv_len);
-            perror("recvfrom");
-            //break;
-            continue;
+        if (data_buffer != NULL) {
+            free_data_buffer(data_buffer, num_rows);
         }
+        return -1; // -1で返すことによって、呼び出し位置(main関数内)でretryする
+    }
+    DEBUG_PRINT("data_idx: %d\n", data_idx);
 
-        // packet連番のチェック
-        packet_number = recv_buf[0] | (recv_buf[1] <<8);
-        if ((packet_number - prev_packet_number) > 1) {
-            fprintf(stderr, "Packet Loss is observed at packet: %d\n", packet_number);
+    // AFEのサンプリングレートで取得されたデータを、WAVファイルは output_rate (ディスク予算で下げたレート) に、
+    // サンプルストアは設定のレートにdownsampleする (同じレートならバッファを共有する)
+    int32_t **wav_buffer = data_buffer;
+    int wav_length = data_idx;
+    if (!features_only && config->write_wav && output_rate < format->sampling_rate) {
+        wav_buffer = create_reduced_buffer(data_buffer, data_idx, num_rows, format->sampling_rate, output_rate, &wav_length);
+    }
+    int32_t **store_buffer = data_buffer;
+    int store_length = data_idx;
+    if (config->write_store && config->sampling_rate < format->sampling_rate) {
+        if (wav_buffer != data_buffer && output_rate == config->sampling_rate) {
+            store_buffer = wav_buffer;
+            store_length = wav_length;
+        } else {
+            store_buffer = create_reduced_buffer(data_buffer, data_idx, num_rows, format->sampling_rate, config->sampling_rate, &store_length);
         }
-        prev_packet_number = packet_number;
+    }
 
+    if (features_only) {
+        // ディスク不足時は特徴量のみを書き出す
+        write_feature_files(filenames, data_buffer, data_idx, format->sampling_rate, config, row_of_sensor);
+    } else {
+        write_wav_files(wav_files, wav_buffer, wav_length, config, row_of_sensor);
+    }
+    if (config->write_store) {
+        write_store_files(store_buffer, store_length, config->sampling_rate, start_ns, config, row_of_sensor);
+    }
+    if (store_buffer != data_buffer && store_buffer != wav_buffer) {
+        free_data_buffer(store_buffer, num_rows);
+    }
+    if (wav_buffer != data_buffer) {
+        free_data_buffer(wav_buffer, num_rows);
+    }
 
-        for (int byte_idx = 2; byte_idx < recv_len; byte_idx += NUM_CHANNELS * sizeof(short)) {
-            for (int channel_idx = 0; channel_idx < NUM_CHANNELS; channel_idx++) {
-                dummy_data_buffer[channel_idx][data_idx] = (int16_t)(recv_buf[byte_idx + channel_idx * 2] | (recv_buf[byte_idx + channel_idx * 2 + 1] << 8));
-                dummy_data_buffer[channel_idx][data_idx] -= 0x7FFF;
-            }
-            data_idx += 1;
-            data_duration += data_period;
-            if (fabs(data_duration - ignore_second) < EPSILON || data_duration > ignore_second)
-                break;
+    free_data_buffer(data_buffer, num_rows);
+
+    // 書き込みが完了したファイルのサイズをインデックスへ確定させる
+    if (storage != NULL) {
+        for (int i = 0; i < config->num_sensors; i++) {
+            storage_commit(storage, storage_records[i]);
         }
     }
-    free_data_buffer(dummy_data_buffer);
 
-    // データ受信
-    data_idx = 0;
-    data_duration = 0.0;
-
-    // データ受信用のdata_buffer[NUM_CHANNEL][配列を初期化
-    int16_t **data_buffer = create_data_buffer(duration, SAMPLING_RATE); // AFEのサンプリングレートは20kHz固定なので、まずはそれを受信して、後でconfig->sampling_rateへdownsampleする
+    return 0;
+}
 
-    DEBUG_PRINT("start recording\n");
-    //DEBUG_PRINT("packet_number: ");
-    while (data_duration < duration) {
-        if (fabs(data_duration - duration) < EPSILON || data_duration > duration)
-            break;
+// num_samples フレーム分のパケットを受信し、channels[0..num_out) のチャンネルを
+// data_buffer[k][0..num_samples) へデコードする。
+// タイムアウトした場合は-1を返す。tapがNULLでなければデコード済みのサンプルを公開する。
+int receive_samples(int sock, const AfeFormat *format, int32_t **data_buffer, const int *channels, int num_out, int num_samples, int *prev_packet_number, LiveTap *tap) {
+    uint8_t recv_buf[AFE_MAX_PACKET_SIZE];
+    int recv_len;
+    int packet_number;
+    int data_idx = 0;
 
-        recv_len = recvfrom(sock, recv_buf, DATA_SIZE, 0, NULL, NULL);
+    while (data_idx < num_samples) {
+        recv_len = recvfrom(sock, recv_buf, format->packet_size, 0, NULL, NULL);
         if (recv_len < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Timeout occurred, continue with next iteration
+                // Timeout occurred
                 printf("Timeout, no data received\n");
-
-                // close & remove files
-                if (sensor_to_record_idx != -1) {
-                    sf_close(wav_files[sensor_to_record_idx]);
-                    remove(filenames[sensor_to_record_idx]);
-                } else {
-                    for (int i = 0; i < config->num_sensors; i++) {
-                        if (strcmp(config->sensors[i].block, block_to_record) == 0) {
-                            sf_close(wav_files[i]);
-                            remove(filenames[i]);
-                        }
-                    }
-                }
-                return -1; // -1で返すことによって、呼び出し位置(main関数内)でretryする
+                return -1;
             } else {
                 perror("recvfrom");
                 exit(1);
             }
         }
-        if (recv_len < DATA_SIZE) {
+        if (recv_len < format->packet_size) {
             fprintf(stderr, "Error: recvfrom() returned %d\n", recv_len);
             perror("recvfrom");
-            //break;
             continue;
         }
 
-        // packet連番のチェック
-        packet_number = recv_buf[0] | (recv_buf[1] <<8);
-        if ((packet_number - prev_packet_number) > 1) {
+        // packet連番のチェック (*prev_packet_numberが-1ならブロックの最初のパケット)
+        packet_number = recv_buf[0] | (recv_buf[1] << 8);
+        if (*prev_packet_number >= 0 && (packet_number - *prev_packet_number) > 1) {
             fprintf(stderr, "Packet Loss is observed at packet: %d\n", packet_number);
         }
-        prev_packet_number = packet_number;
+        *prev_packet_number = packet_number;
+
+        int num_frames = format->frames_per_packet;
+        if (num_frames > num_samples - data_idx) {
+            num_frames = num_samples - data_idx;
+        }
+        format->decode(recv_buf + AFE_HEADER_SIZE, num_frames, data_buffer, data_idx, channels, num_out);
 
-        for (int byte_idx = 2; byte_idx < recv_len; byte_idx += NUM_CHANNELS * sizeof(short)) {
-            for (int channel_idx = 0; channel_idx < NUM_CHANNELS; channel_idx++) {
-                data_buffer[channel_idx][data_idx] = (int16_t)(recv_buf[byte_idx + channel_idx * 2] | (recv_buf[byte_idx + channel_idx * 2 + 1] << 8));
-                data_buffer[channel_idx][data_idx] -= 0x7FFF;
+        // デコード済みのサンプルをlive tapへ公開 (読み出し側を待つことはない)
+        if (tap != NULL) {
+            livetap_publish(tap, data_buffer, num_out, data_idx, num_frames);
+        }
+        data_idx += num_frames;
+    }
+    return 0;
+}
+
+void write_wav_files(SNDFILE **wav_files, int32_t **data_buffer, int data_idx, Config *config, int *row_of_sensor) {
+    for (int i = 0; i < config->num_sensors; i++) {
+        if (wav_files[i] == NULL) {
+            continue;
+        }
+        if (sf_write_int(wav_files[i], data_buffer[row_of_sensor[i]], data_idx) != data_idx) {
+            fprintf(stderr, "Error: sf_write_int() failed\n");
+            exit(1);
+        }
+        sf_write_sync(wav_files[i]);
+        sf_close(wav_files[i]);
+    } // for (int i = 0; i < config->num_sensors; i++)
+}
+
+// data_buffer[row][from..to) のpeakとRMSからセンサー毎にゲインを選び直し、config->sensorsを更新する。
+// 入力はゲインに比例すると仮定し、クリップの恐れがあるか弱すぎるチャンネルだけを、
+// peakがAUTO_RANGE_TARGET_PEAKを超えない最大のゲインに変える。ゲインを下げるのはクリップの恐れがある場合だけで、
+// 弱すぎる場合はゲインを上げられるときだけ変える (peakの大きいスパイクで逆に下がらないように)。変更があれば1を返す
+int auto_range_gains(Config *config, int32_t **data_buffer, int from, int to, const int *row_of_sensor) {
+    int changed = 0;
+    int num_gains = sizeof(gain_data_map) / sizeof(GainData);
+
+    for (int i = 0; i < config->num_sensors; i++) {
+        int row = row_of_sensor[i];
+        int gain = config->sensors[i].gain;
+        if (row < 0 || gain <= 0 || to <= from) {
+            continue; // gain 0 のチャンネルは使われていない
+        }
+        double sum_sq = 0.0, peak = 0.0;
+        for (int j = from; j < to; j++) {
+            double v = fabs(data_buffer[row][j] / 2147483648.0);
+            sum_sq += v * v;
+            if (v > peak) {
+                peak = v;
             }
-            data_idx += 1;
-            data_duration += data_period;
-            if (fabs(data_duration - duration) < EPSILON || data_duration > duration)
-                break;
+        }
+        double rms = sqrt(sum_sq / (to - from));
+        DEBUG_PRINT("auto range: %s gain=%d peak=%.4f rms=%.4f\n", config->sensors[i].label, gain, peak, rms);
+        if (peak < AUTO_RANGE_SILENT_PEAK || (peak < AUTO_RANGE_CLIP_PEAK && rms >= AUTO_RANGE_WEAK_RMS)) {
+            continue;
+        }
+        int clipping = peak >= AUTO_RANGE_CLIP_PEAK;
+
+        // クリップしている場合は実際の入力はこれ以上なので、下げ幅が足りなければ次回さらに下がる
+        double input_peak = peak / gain;
+        int new_gain = 0;
+        for (int m = 0; m < num_gains; m++) {
+            if (gain_data_map[m].gain > 0 && (new_gain == 0 || input_peak * gain_data_map[m].gain <= AUTO_RANGE_TARGET_PEAK)) {
+                new_gain = gain_data_map[m].gain;
+            }
+        }
+        if (!clipping && new_gain < gain) {
+            continue;
+        }
+        if (new_gain != gain) {
+            fprintf(stderr, "auto range: gain of %s %d -> %d (peak %.3f, rms %.4f)\n", config->sensors[i].label, gain, new_gain, peak, rms);
+            config->sensors[i].gain = new_gain;
+            gains_changed = 1;
+            changed = 1;
         }
     }
-    DEBUG_PRINT("data_duration: %f\n", data_duration);
-    DEBUG_PRINT("data_idx: %d\n", data_idx);
-    DEBUG_PRINT("duration_in_samples: %d\n", (int)(duration * SAMPLING_RATE));
-
-    if (config->sampling_rate < SAMPLING_RATE) {
-        DEBUG_PRINT("downsampling from 20kHz to %dHz\n", config->sampling_rate);
-        // AFEで20kHzで取得されたデータを config->sampling_rate にdownsample する
-        int reduced_length = (int)ceil((double)data_idx * config->sampling_rate / SAMPLING_RATE);
-        DEBUG_PRINT("reduced_length: %d\n", reduced_length);
-        int16_t** reduced_data_buffer = malloc(NUM_CHANNELS * sizeof(int16_t*));
-        for (int i = 0; i < NUM_CHANNELS; i++) {
-            reduced_data_buffer[i] = calloc(reduced_length, sizeof(int16_t));
-            downsample(data_buffer[i], reduced_data_buffer[i], reduced_length, SAMPLING_RATE, config->sampling_rate);
-        }
-        write_wav_files(wav_files, reduced_data_buffer, reduced_length, sensor_to_record_idx, block_to_record, config, channel_of_sensor);
-        free_data_buffer(reduced_data_buffer);
-    } else {
-        // AFEで20kHzで取得されたデータをそのまま書き込む
-        write_wav_files(wav_files, data_buffer, data_idx, sensor_to_record_idx, block_to_record, config, channel_of_sensor);
+    return changed;
+}
+
+// configファイルの各センサーの行 ({label: "S01", ..., gain: 100}) のゲインを現在の値に書き換える。
+// 一時ファイルに書いてfsyncしてからrenameするので、途中で落ちても元のファイルか新しいファイルのどちらかが残る
+int save_gains(const char *filename, Config *config) {
+    char tmp_filename[PATH_MAX];
+    char line[BUF_SIZE];
+    struct stat st;
+
+    FILE *in = fopen(filename, "r");
+    if (in == NULL || fstat(fileno(in), &st) < 0) {
+        fprintf(stderr, "Warning: failed to read config file [%s] to save the gains: %s\n", filename, strerror(errno));
+        if (in != NULL) {
+            fclose(in);
+        }
+        return -1;
+    }
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp.%d", filename, (int)getpid());
+    FILE *out = fopen(tmp_filename, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Warning: failed to create [%s] to save the gains: %s\n", tmp_filename, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+    fchmod(fileno(out), st.st_mode & 07777);
+
+    int saved[MAX_SENSORS] = { 0 };
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *label = strstr(line, "label:");
+        char *gain = strstr(line, "gain:");
+        int replaced = 0;
+        if (label != NULL && gain != NULL && gain > label) {
+            label += strlen("label:");
+            label += strspn(label, " \t\"'");
+            size_t label_len = strcspn(label, " \t\"',}");
+            gain += strlen("gain:");
+            gain += strspn(gain, " \t");
+            size_t gain_len = strspn(gain, "0123456789");
+            for (int i = 0; i < config->num_sensors && i < MAX_SENSORS; i++) {
+                if (gain_len > 0 && strlen(config->sensors[i].label) == label_len && strncmp(config->sensors[i].label, label, label_len) == 0) {
+                    fprintf(out, "%.*s%d%s", (int)(gain - line), line, config->sensors[i].gain, gain + gain_len);
+                    saved[i] = replaced = 1;
+                    break;
+                }
+            }
+        }
+        if (!replaced) {
+            fputs(line, out);
+        }
     }
+    fclose(in);
 
-    free_data_buffer(data_buffer);
+    int retval = 0;
+    if (fflush(out) != 0 || fsync(fileno(out)) < 0) {
+        retval = -1;
+    }
+    if (fclose(out) != 0) {
+        retval = -1;
+    }
+    if (retval == 0 && rename(tmp_filename, filename) < 0) {
+        retval = -1;
+    }
+    if (retval < 0) {
+        fprintf(stderr, "Warning: failed to save the gains to config file [%s]: %s\n", filename, strerror(errno));
+        remove(tmp_filename);
+        return -1;
+    }
 
+    // renameをディスクへ反映させる
+    char dir_path[PATH_MAX];
+    snprintf(dir_path, sizeof(dir_path), "%s", filename);
+    int dir_fd = open(dirname(dir_path), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    for (int i = 0; i < config->num_sensors && i < MAX_SENSORS; i++) {
+        if (!saved[i]) {
+            fprintf(stderr, "Warning: gain of %s is not saved. write it as {label: \"%s\", ..., gain: %d} in one line.\n",
+                    config->sensors[i].label, config->sensors[i].label, config->sensors[i].gain);
+        }
+    }
+    fprintf(stderr, "saved the gains to config file [%s]\n", filename);
     return 0;
 }
 
-void write_wav_files(SNDFILE **wav_files, int16_t **data_buffer, int data_idx, int sensor_to_record_idx, const char *block_to_record, Config *config, int *channel_of_sensor) {
-    if (sensor_to_record_idx != -1) { // write specified sensor
-        if (sf_write_short(wav_files[sensor_to_record_idx], data_buffer[channel_of_sensor[sensor_to_record_idx]], data_idx) != data_idx) {
-            fprintf(stderr, "Error: sf_write_short() failed\n");
-            exit(1);
+// センサー毎のサンプルストアへ追記する。失敗してもWAVファイルの書き出しやデータ取得は続ける
+void write_store_files(int32_t **data_buffer, int data_idx, int sampling_rate, int64_t start_ns, Config *config, int *row_of_sensor) {
+    for (int i = 0; i < config->num_sensors; i++) {
+        if (row_of_sensor[i] < 0) {
+            continue;
         }
-        sf_write_sync(wav_files[sensor_to_record_idx]);
-        sf_close(wav_files[sensor_to_record_idx]);
-    } else { // write all sensors
-        for (int i = 0; i < config->num_sensors; i++) {
-            if (strcmp(config->sensors[i].block, block_to_record) == 0) {
-                if (sf_write_short(wav_files[i], data_buffer[channel_of_sensor[i]], data_idx) != data_idx) {
-                    fprintf(stderr, "Error: sf_write_short() failed\n");
-                    exit(1);
-                }
-                sf_write_sync(wav_files[i]);
-                sf_close(wav_files[i]);
-            }
-        } // for (int i = 0; i < config->num_sensors; i++)
+        ChunkStore *cs = chunkstore_open(config->sample_store, config->sensors[i].label);
+        if (cs == NULL) {
+            continue;
+        }
+        DEBUG_PRINT("appending %d samples of %s to the sample store\n", data_idx, config->sensors[i].label);
+        chunkstore_append(cs, start_ns, sampling_rate, data_buffer[row_of_sensor[i]], data_idx);
+        // 上限を超えたら古いチャンクから捨てる
+        if (config->sample_store_mb > 0) {
+            chunkstore_trim(cs, (int64_t)(config->sample_store_mb * 1024 * 1024));
+        }
+        chunkstore_close(cs);
+    }
+}
+
+// 特徴量 (平均, RMS, peak; フルスケールに対する比) をセンサー毎のCSVファイルに書き出す
+void write_feature_files(char filenames[][BUF_SIZE * 3], int32_t **data_buffer, int data_idx, int sampling_rate, Config *config, int *row_of_sensor) {
+    for (int i = 0; i < config->num_sensors; i++) {
+        if (strcmp(filenames[i], "") == 0) {
+            continue;
+        }
+        double sum = 0.0, sum_sq = 0.0, peak = 0.0;
+        for (int j = 0; j < data_idx; j++) {
+            double v = data_buffer[row_of_sensor[i]][j] / 2147483648.0;
+            sum += v;
+            sum_sq += v * v;
+            if (fabs(v) > peak) peak = fabs(v);
+        }
+        fprintf(stderr, "creating feature file [%s] for the sensor [%s]\n", filenames[i], config->sensors[i].label);
+        FILE *fp = fopen(filenames[i], "w");
+        if (fp == NULL) {
+            // ここで失敗しても取得自体は失敗扱いにしない
+            perror("fopen (feature file)");
+            continue;
+        }
+        fprintf(fp, "label,samples,sampling_rate,mean,rms,peak\n");
+        fprintf(fp, "%s,%d,%d,%.6f,%.6f,%.6f\n", config->sensors[i].label, data_idx, sampling_rate,
+            data_idx > 0 ? sum / data_idx : 0.0, data_idx > 0 ? sqrt(sum_sq / data_idx) : 0.0, peak);
+        fclose(fp);
     }
 }
 
@@ -641,8 +1386,8 @@ int send_start_command_of_block(int sock, struct sockaddr_in *serv_addr, Config
         }
     }
 
-    // Set gain for 1-4 channels of the block
-    for (int j = 0; j < NUM_CHANNELS; j++) {
+    // Set gain for each channel of the block
+    for (int j = 0; j < config->format->num_channels; j++) {
         snprintf(channel, BUF_SIZE, "%d", j + 1);
         start_command[3 + j] = 0x00;
         for (int k = 0; k < config->num_sensors; k++) {
@@ -667,7 +1412,7 @@ int send_start_command_of_block(int sock, struct sockaddr_in *serv_addr, Config
     DEBUG_PRINT("Sent start command to AFE: ");
     for (int k = 0; k < 2; k++)
         DEBUG_PRINT("%c ", start_command[k]);
-    for (int k = 2; k < 7; k++)
+    for (int k = 2; k < 3 + config->format->num_channels; k++)
         DEBUG_PRINT("0x%x ", start_command[k]);
     DEBUG_PRINT("\n");
 
@@ -756,7 +1501,7 @@ void clear_remaining_buffer(int sock) {
     fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
     // clear remaining buffer
-    char tmp_buffer[1026];
+    char tmp_buffer[AFE_MAX_PACKET_SIZE];
     while (recvfrom(sock, tmp_buffer, sizeof(tmp_buffer), 0, NULL, NULL) > 0) {
     }
 
@@ -784,23 +1529,36 @@ void set_timeout(int sock) {
     }
 }
 
-int16_t** create_data_buffer(double duration, int sampling_rate) {
+int32_t** create_data_buffer(double duration, int sampling_rate, int num_channels) {
     int duration_in_samples = (int)(duration * sampling_rate);
-    int16_t** data_buffer = malloc(NUM_CHANNELS * sizeof(int16_t*));
-    for (int i = 0; i < NUM_CHANNELS; i++) {
-        data_buffer[i] = calloc(duration_in_samples, sizeof(int16_t));
+    int32_t** data_buffer = malloc(num_channels * sizeof(int32_t*));
+    for (int i = 0; i < num_channels; i++) {
+        data_buffer[i] = calloc(duration_in_samples, sizeof(int32_t));
     }
     return data_buffer;
 }
 
-void free_data_buffer(int16_t** data_buffer) {
-    for (int i = 0; i < NUM_CHANNELS; i++) {
+void free_data_buffer(int32_t** data_buffer, int num_channels) {
+    for (int i = 0; i < num_channels; i++) {
         free(data_buffer[i]);
     }
     free(data_buffer);
 }
 
-void downsample(int16_t *original_data, int16_t *reduced_data, int reduced_length, int original_rate, int new_rate) {
+// data_bufferの各行をnew_rateにdownsampleしたバッファを作る
+int32_t** create_reduced_buffer(int32_t **data_buffer, int data_idx, int num_rows, int original_rate, int new_rate, int *reduced_length) {
+    DEBUG_PRINT("downsampling from %dHz to %dHz\n", original_rate, new_rate);
+    *reduced_length = (int)ceil((double)data_idx * new_rate / original_rate);
+    DEBUG_PRINT("reduced_length: %d\n", *reduced_length);
+    int32_t** reduced_data_buffer = malloc(num_rows * sizeof(int32_t*));
+    for (int i = 0; i < num_rows; i++) {
+        reduced_data_buffer[i] = calloc(*reduced_length, sizeof(int32_t));
+        downsample(data_buffer[i], reduced_data_buffer[i], *reduced_length, original_rate, new_rate);
+    }
+    return reduced_data_buffer;
+}
+
+void downsample(int32_t *original_data, int32_t *reduced_data, int reduced_length, int original_rate, int new_rate) {
     float step = (float)original_rate / (float)new_rate;
     for (int i = 0; i < reduced_length; i++) {
         int index = (int)(i * step);
@@ -0,0 +1,190 @@
+// emgetdataのサンプルストア (chunkstore) の読み出しツール。
+// インデックスをmmapして時刻で二分探索し、指定範囲に掛かるチャンクだけを展開する。
+// -S指定時はインデックスのmin/max/RMSだけを出力し、データファイルには触れない。
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <math.h>
+#include "chunkstore.h"
+
+#define DEFAULT_STORE_DIR "store"
+
+void usage() {
+    fprintf(stderr, "Usage: emstore [-d store_dir] -l\n");
+    fprintf(stderr, "       emstore [-d store_dir] -s sensor [-f from] [-t to] [-S | -r]\n");
+    fprintf(stderr, "  -d store_dir: sample store directory. default: %s\n", DEFAULT_STORE_DIR);
+    fprintf(stderr, "  -l: list the sensors in the store with their time coverage\n");
+    fprintf(stderr, "  -s sensor: sensor label to read\n");
+    fprintf(stderr, "  -f from, -t to: time range in local time (\"YYYY-MM-DD HH:MM:SS\" or YYYYMMDDHHMMSS) or unix time.\n");
+    fprintf(stderr, "                  default: the whole store\n");
+    fprintf(stderr, "  -S: print the per-chunk summary (time, samples, min, max, rms) instead of the samples\n");
+    fprintf(stderr, "  -r: write the samples as raw int32 (little endian, left-justified) instead of text\n");
+    fprintf(stderr, "  -h: show this help\n");
+    fprintf(stderr, "text output is \"unix_time,value\" per sample (value relative to full scale).\n");
+}
+
+static int64_t parse_time(const char *s) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+    if (end == NULL || *end != '\0') {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(s, "%Y%m%d%H%M%S", &tm);
+    }
+    if (end != NULL && *end == '\0' && strlen(s) >= 14) {
+        tm.tm_isdst = -1;
+        return (int64_t)mktime(&tm) * 1000000000LL;
+    }
+    char *num_end;
+    double t = strtod(s, &num_end);
+    if (*s == '\0' || *num_end != '\0') {
+        fprintf(stderr, "Error: invalid time [%s]\n", s);
+        exit(1);
+    }
+    return (int64_t)llround(t * 1e9); // 切り捨てると1ns手前になり、境界ちょうどのサンプルを落とすことがある
+}
+
+static void format_time(int64_t t_ns, char *buf, size_t size) {
+    time_t t = (time_t)(t_ns / 1000000000LL);
+    struct tm tm = *localtime(&t);
+    strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+static void list_store(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        exit(1);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0) {
+            continue;
+        }
+        char label[CHUNKSTORE_LABEL_LEN];
+        snprintf(label, sizeof(label), "%.*s", (int)(len - 4), entry->d_name);
+        ChunkStoreReader *reader = chunkstore_map(dir, label);
+        if (reader == NULL) {
+            continue;
+        }
+        if (reader->num_records > 0) {
+            char from[64], to[64];
+            format_time(reader->records[0].start_ns, from, sizeof(from));
+            format_time(chunkstore_end_ns(&reader->records[reader->num_records - 1]), to, sizeof(to));
+            printf("%s\t%s - %s\t%llu chunks\t%zu bytes\n", label, from, to, (unsigned long long)reader->num_records, reader->dat_size);
+        } else {
+            printf("%s\t(empty)\n", label);
+        }
+        chunkstore_unmap(reader);
+    }
+    closedir(d);
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = DEFAULT_STORE_DIR;
+    const char *label = NULL;
+    int64_t from_ns = INT64_MIN;
+    int64_t to_ns = INT64_MAX;
+    int list = 0, summary = 0, raw = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:ls:f:t:Srh")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'l':
+                list = 1;
+                break;
+            case 's':
+                label = optarg;
+                break;
+            case 'f':
+                from_ns = parse_time(optarg);
+                break;
+            case 't':
+                to_ns = parse_time(optarg);
+                break;
+            case 'S':
+                summary = 1;
+                break;
+            case 'r':
+                raw = 1;
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+
+    if (list) {
+        list_store(dir);
+        return 0;
+    }
+    if (label == NULL) {
+        usage();
+        exit(1);
+    }
+
+    ChunkStoreReader *reader = chunkstore_map(dir, label);
+    if (reader == NULL) {
+        fprintf(stderr, "Error: sensor [%s] is not found in the sample store [%s]\n", label, dir);
+        exit(1);
+    }
+
+    int32_t samples[CHUNKSTORE_CHUNK_SAMPLES];
+    uint64_t decoded = 0, written = 0;
+    for (uint64_t i = chunkstore_find(reader, from_ns); i < reader->num_records; i++) {
+        const ChunkRecord *rec = &reader->records[i];
+        if (rec->start_ns >= to_ns) {
+            break;
+        }
+        if (summary) {
+            printf("%.6f,%u,%u,%.6f,%.6f,%.6f\n", rec->start_ns / 1e9, rec->num_samples, rec->sample_rate,
+                   rec->min / 2147483648.0, rec->max / 2147483648.0, rec->rms);
+            continue;
+        }
+
+        int n = chunkstore_decode(reader, rec, samples);
+        if (n < 0) {
+            fprintf(stderr, "Warning: chunk %llu of %s is corrupted. skipped.\n", (unsigned long long)i, label);
+            continue;
+        }
+        decoded++;
+        // 範囲の端のチャンクは範囲内のサンプルだけを出力する
+        double period_ns = 1e9 / rec->sample_rate;
+        int first = 0, last = n;
+        if (rec->start_ns < from_ns) {
+            first = (int)((from_ns - rec->start_ns + period_ns - 1) / period_ns);
+        }
+        if (chunkstore_end_ns(rec) > to_ns) {
+            last = (int)((to_ns - rec->start_ns + period_ns - 1) / period_ns);
+        }
+        if (first >= last) {
+            continue;
+        }
+        if (raw) {
+            fwrite(samples + first, sizeof(int32_t), last - first, stdout);
+        } else {
+            for (int j = first; j < last; j++) {
+                printf("%.6f,%.6f\n", (rec->start_ns + j * period_ns) / 1e9, samples[j] / 2147483648.0);
+            }
+        }
+        written += last - first;
+    }
+    if (!summary) {
+        fprintf(stderr, "%llu samples from %llu of %llu chunks\n", (unsigned long long)written, (unsigned long long)decoded, (unsigned long long)reader->num_records);
+    }
+
+    chunkstore_unmap(reader);
+    return 0;
+}
@@ -0,0 +1,130 @@
+// emgetdataのライブタップを読み出す参照実装。
+// 1秒毎にチャンネル別のpeak/RMSを表示する。-r指定時はサンプルをそのままテキストで出力する。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+#include "livetap.h"
+
+#define READ_FRAMES 4096
+#define DEFAULT_TAP_NAME "/emgetdata"
+
+void usage() {
+    fprintf(stderr, "Usage: emtap [-n tap_name] [-r]\n");
+    fprintf(stderr, "  -n tap_name: shared memory name of the live tap. default: %s\n", DEFAULT_TAP_NAME);
+    fprintf(stderr, "  -r: dump raw samples instead of per-second statistics\n");
+    fprintf(stderr, "  -h: show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *tap_name = DEFAULT_TAP_NAME;
+    int raw = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:rh")) != -1) {
+        switch (opt) {
+            case 'n':
+                tap_name = optarg;
+                break;
+            case 'r':
+                raw = 1;
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+
+    int32_t *buffer[LIVETAP_MAX_CHANNELS];
+    for (int i = 0; i < LIVETAP_MAX_CHANNELS; i++) {
+        buffer[i] = malloc(READ_FRAMES * sizeof(int32_t));
+    }
+
+    while (1) {
+        // emgetdataが起動するまで待つ。終了(closed)したら次の起動で作られるセグメントへ付け直す
+        LiveTap *tap = livetap_open(tap_name);
+        if (tap == NULL) {
+            usleep(500000);
+            continue;
+        }
+        if (atomic_load(&tap->header->state) == 0) {
+            livetap_detach(tap);
+            usleep(500000);
+            continue;
+        }
+
+        int num_channels = tap->header->num_channels;
+        uint64_t pos = atomic_load(&tap->header->write_seq);
+        uint64_t overruns = 0;
+        LiveTapLayout layout;
+        memset(&layout, 0, sizeof(layout));
+
+        double peak[LIVETAP_MAX_CHANNELS] = {0};
+        double sum_sq[LIVETAP_MAX_CHANNELS] = {0};
+        uint32_t stat_frames = 0;
+
+        while (1) {
+            int n = livetap_read(tap, &pos, buffer, READ_FRAMES);
+            if (n == LIVETAP_CLOSED) {
+                break;
+            }
+            if (n == LIVETAP_OVERRUN) {
+                overruns++;
+                fprintf(stderr, "overrun: reader was overtaken by the writer (%llu)\n", (unsigned long long)overruns);
+                continue;
+            }
+            if (n == 0) {
+                usleep(10000);
+                continue;
+            }
+
+            LiveTapLayout current;
+            if (livetap_get_layout(tap, &current) == 0 && memcmp(&current, &layout, sizeof(layout)) != 0) {
+                layout = current;
+                fprintf(stderr, "block %s, %u Hz:", layout.block, layout.sample_rate);
+                for (int ch = 0; ch < num_channels; ch++) {
+                    fprintf(stderr, " ch%d=%s", ch + 1, layout.labels[ch][0] ? layout.labels[ch] : "-");
+                }
+                fputc('\n', stderr);
+                stat_frames = 0;
+                memset(peak, 0, sizeof(peak));
+                memset(sum_sq, 0, sizeof(sum_sq));
+            }
+
+            for (int i = 0; i < n; i++) {
+                for (int ch = 0; ch < num_channels; ch++) {
+                    double v = buffer[ch][i] / 2147483648.0;
+                    if (raw) {
+                        printf(ch == 0 ? "%d" : " %d", buffer[ch][i]);
+                    }
+                    if (fabs(v) > peak[ch]) peak[ch] = fabs(v);
+                    sum_sq[ch] += v * v;
+                }
+                if (raw) {
+                    putchar('\n');
+                }
+                stat_frames++;
+
+                if (!raw && layout.sample_rate > 0 && stat_frames >= layout.sample_rate) {
+                    printf("%s", layout.block);
+                    for (int ch = 0; ch < num_channels; ch++) {
+                        if (layout.labels[ch][0] == '\0') continue;
+                        printf(" %s: peak=%.4f rms=%.4f", layout.labels[ch], peak[ch], sqrt(sum_sq[ch] / stat_frames));
+                    }
+                    putchar('\n');
+                    fflush(stdout);
+                    stat_frames = 0;
+                    memset(peak, 0, sizeof(peak));
+                    memset(sum_sq, 0, sizeof(sum_sq));
+                }
+            }
+        }
+        livetap_detach(tap);
+    }
+    return 0;
+}
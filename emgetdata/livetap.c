@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "livetap.h"
+#include "debug.h"
+
+#define LIVETAP_ALIGN 64
+
+static size_t livetap_data_offset(void) {
+    return (sizeof(LiveTapHeader) + LIVETAP_ALIGN - 1) & ~((size_t)LIVETAP_ALIGN - 1);
+}
+
+static int32_t *livetap_channel(LiveTap *tap, int channel) {
+    return tap->samples + (size_t)channel * tap->header->capacity;
+}
+
+LiveTap *livetap_create(const char *name, int num_channels, double seconds, int sampling_rate) {
+    if (num_channels <= 0 || num_channels > LIVETAP_MAX_CHANNELS) {
+        fprintf(stderr, "Error: live tap supports up to %d channels\n", LIVETAP_MAX_CHANNELS);
+        return NULL;
+    }
+
+    // リング長は2のべき乗に切り上げる (インデックス計算をマスクで済ませるため)
+    uint32_t capacity = 1024;
+    while (capacity < seconds * sampling_rate && capacity < (1u << 24)) {
+        capacity <<= 1;
+    }
+
+    LiveTap *tap = calloc(1, sizeof(LiveTap));
+    snprintf(tap->name, sizeof(tap->name), "%s", name);
+    tap->size = livetap_data_offset() + (size_t)num_channels * capacity * sizeof(int32_t);
+
+    // 前回の実行で残ったセグメントにアタッチしている読み出し側は state=closed で気付けるように、
+    // 古いセグメントは作り直さずunlinkして新しく作成する
+    shm_unlink(name);
+    tap->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (tap->fd < 0) {
+        perror("shm_open");
+        free(tap);
+        return NULL;
+    }
+    if (ftruncate(tap->fd, tap->size) < 0) {
+        perror("ftruncate");
+        close(tap->fd);
+        shm_unlink(name);
+        free(tap);
+        return NULL;
+    }
+    void *base = mmap(NULL, tap->size, PROT_READ | PROT_WRITE, MAP_SHARED, tap->fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(tap->fd);
+        shm_unlink(name);
+        free(tap);
+        return NULL;
+    }
+
+    tap->header = base;
+    tap->samples = (int32_t *)((char *)base + livetap_data_offset());
+    tap->header->capacity = capacity;
+    tap->header->num_channels = num_channels;
+    tap->header->data_offset = livetap_data_offset();
+    tap->header->version = LIVETAP_VERSION;
+    atomic_store(&tap->header->claim_seq, 0);
+    atomic_store(&tap->header->write_seq, 0);
+    atomic_store(&tap->header->state, 1);
+    // magicは最後に書く: 読み出し側はmagicを見てから他のフィールドを信用する
+    atomic_thread_fence(memory_order_release);
+    tap->header->magic = LIVETAP_MAGIC;
+
+    DEBUG_PRINT("live tap %s: %d channels x %u frames\n", name, num_channels, capacity);
+    return tap;
+}
+
+void livetap_set_layout(LiveTap *tap, int sample_rate, const char *block, const char **labels) {
+    LiveTapHeader *h = tap->header;
+
+    atomic_fetch_add_explicit(&h->layout_seq, 1, memory_order_relaxed); // odd: updating
+    atomic_thread_fence(memory_order_seq_cst);
+    h->sample_rate = sample_rate;
+    snprintf(h->block, sizeof(h->block), "%s", block);
+    for (uint32_t i = 0; i < h->num_channels; i++) {
+        snprintf(h->labels[i], LIVETAP_LABEL_LEN, "%s", labels[i] != NULL ? labels[i] : "");
+    }
+    atomic_fetch_add_explicit(&h->layout_seq, 1, memory_order_release); // even: stable
+}
+
+// data_buffer[channel][offset .. offset+num_frames) をリングへ追記する。読み出し側は待たない。
+// num_channelsがタップのチャンネル数より少ない場合 (-s/-bで一部のセンサーだけ取得する場合)、
+// 残りのチャンネルには前のブロックのサンプルが残らないよう0を書く (ラベルは""になっている)。
+void livetap_publish(LiveTap *tap, int32_t **data_buffer, int num_channels, int offset, int num_frames) {
+    LiveTapHeader *h = tap->header;
+    uint32_t mask = h->capacity - 1;
+    uint64_t seq = atomic_load_explicit(&h->write_seq, memory_order_relaxed);
+
+    if (num_frames <= 0) {
+        return;
+    }
+    if ((uint32_t)num_frames > h->capacity) {
+        offset += num_frames - h->capacity;
+        seq += num_frames - h->capacity;
+        num_frames = h->capacity;
+    }
+
+    // これから上書きする範囲を先に宣言してからサンプルを書き込む。
+    // 読み出し側はコピー後にclaim_seqを見て、自分の読んだ範囲が上書きされ得たかを判定する。
+    atomic_store_explicit(&h->claim_seq, seq + num_frames, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint32_t start = seq & mask;
+    uint32_t first = num_frames;
+    if (start + first > h->capacity) {
+        first = h->capacity - start;
+    }
+    for (uint32_t ch = 0; ch < h->num_channels; ch++) {
+        int32_t *ring = livetap_channel(tap, ch);
+        if (ch < (uint32_t)num_channels) {
+            memcpy(ring + start, data_buffer[ch] + offset, first * sizeof(int32_t));
+            memcpy(ring, data_buffer[ch] + offset + first, (num_frames - first) * sizeof(int32_t));
+        } else {
+            memset(ring + start, 0, first * sizeof(int32_t));
+            memset(ring, 0, (num_frames - first) * sizeof(int32_t));
+        }
+    }
+
+    atomic_store_explicit(&h->write_seq, seq + num_frames, memory_order_release);
+}
+
+void livetap_close(LiveTap *tap) {
+    if (tap == NULL) {
+        return;
+    }
+    // セグメント自体は残す: 読み出し側は最後の内容を読み切ってから state=closed を見て離脱する
+    atomic_store_explicit(&tap->header->state, 0, memory_order_release);
+    livetap_detach(tap);
+}
+
+LiveTap *livetap_open(const char *name) {
+    LiveTap *tap = calloc(1, sizeof(LiveTap));
+    snprintf(tap->name, sizeof(tap->name), "%s", name);
+
+    tap->fd = shm_open(name, O_RDONLY, 0);
+    if (tap->fd < 0) {
+        free(tap);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(tap->fd, &st) < 0 || (size_t)st.st_size < sizeof(LiveTapHeader)) {
+        close(tap->fd);
+        free(tap);
+        return NULL;
+    }
+    tap->size = st.st_size;
+    void *base = mmap(NULL, tap->size, PROT_READ, MAP_SHARED, tap->fd, 0);
+    if (base == MAP_FAILED) {
+        close(tap->fd);
+        free(tap);
+        return NULL;
+    }
+    tap->header = base;
+    atomic_thread_fence(memory_order_acquire);
+    // ヘッダは他のプロセスが書いたものなので、livetap_createと同じ制約 (チャンネル数、2のべき乗のリング長) も確かめる
+    uint32_t num_channels = tap->header->num_channels;
+    uint32_t capacity = tap->header->capacity;
+    if (tap->header->magic != LIVETAP_MAGIC || tap->header->version != LIVETAP_VERSION
+        || num_channels == 0 || num_channels > LIVETAP_MAX_CHANNELS
+        || capacity == 0 || (capacity & (capacity - 1)) != 0
+        || tap->header->data_offset < sizeof(LiveTapHeader)
+        || tap->header->data_offset + (size_t)num_channels * capacity * sizeof(int32_t) > tap->size) {
+        livetap_detach(tap);
+        return NULL;
+    }
+    tap->samples = (int32_t *)((char *)base + tap->header->data_offset);
+    return tap;
+}
+
+// sample_rate/block/labelsの一貫したスナップショットを取得する。更新中に当たった場合は-1
+int livetap_get_layout(LiveTap *tap, LiveTapLayout *layout) {
+    LiveTapHeader *h = tap->header;
+    uint32_t before = atomic_load_explicit(&h->layout_seq, memory_order_acquire);
+    if (before & 1) {
+        return -1;
+    }
+    layout->sample_rate = h->sample_rate;
+    memcpy(layout->block, h->block, sizeof(layout->block));
+    memcpy(layout->labels, h->labels, sizeof(layout->labels));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&h->layout_seq, memory_order_relaxed) != before) {
+        return -1;
+    }
+    layout->block[sizeof(layout->block) - 1] = '\0';
+    for (int i = 0; i < LIVETAP_MAX_CHANNELS; i++) {
+        layout->labels[i][LIVETAP_LABEL_LEN - 1] = '\0';
+    }
+    return 0;
+}
+
+// *pos から最大 max_frames フレームを out[channel] へコピーし、読んだフレーム数を返す。
+// 書き込み側に追い越されていた場合は *pos を最新位置へ進めて LIVETAP_OVERRUN を返す。
+// 書き込み側が終了していて読むものが無ければ LIVETAP_CLOSED を返す。
+int livetap_read(LiveTap *tap, uint64_t *pos, int32_t **out, int max_frames) {
+    LiveTapHeader *h = tap->header;
+    uint32_t mask = h->capacity - 1;
+    uint64_t written = atomic_load_explicit(&h->write_seq, memory_order_acquire);
+
+    if (written == *pos) {
+        if (atomic_load_explicit(&h->state, memory_order_acquire) == 0
+            && atomic_load_explicit(&h->write_seq, memory_order_acquire) == *pos) {
+            return LIVETAP_CLOSED;
+        }
+        return 0;
+    }
+    if (written < *pos || written - *pos > h->capacity) {
+        *pos = written;
+        return LIVETAP_OVERRUN;
+    }
+
+    uint64_t available = written - *pos;
+    int num_frames = available < (uint64_t)max_frames ? (int)available : max_frames;
+    uint32_t start = *pos & mask;
+    uint32_t first = num_frames;
+    if (start + first > h->capacity) {
+        first = h->capacity - start;
+    }
+    for (uint32_t ch = 0; ch < h->num_channels; ch++) {
+        const int32_t *ring = livetap_channel(tap, ch);
+        memcpy(out[ch], ring + start, first * sizeof(int32_t));
+        memcpy(out[ch] + first, ring, (num_frames - first) * sizeof(int32_t));
+    }
+
+    // コピー中に書き込み側が読んだ範囲へ回り込んでいたらデータは壊れている
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t claimed = atomic_load_explicit(&h->claim_seq, memory_order_relaxed);
+    if (claimed - *pos > h->capacity) {
+        *pos = atomic_load_explicit(&h->write_seq, memory_order_acquire);
+        return LIVETAP_OVERRUN;
+    }
+
+    *pos += num_frames;
+    return num_frames;
+}
+
+void livetap_detach(LiveTap *tap) {
+    if (tap == NULL) {
+        return;
+    }
+    munmap(tap->header, tap->size);
+    close(tap->fd);
+    free(tap);
+}
@@ -0,0 +1,61 @@
+#ifndef LIVETAP_H
+#define LIVETAP_H
+
+// ライブタップ: デコード済みのチャンネル別サンプルをPOSIX共有メモリ上のリングバッファへ公開する。
+// 書き込み側(emgetdata)は読み出し側を一切待たない。読み出し側も待たずに追従し、
+// 追い越された場合は LIVETAP_OVERRUN で検出する。
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LIVETAP_MAGIC 0x50415445 // "ETAP"
+#define LIVETAP_VERSION 2
+#define LIVETAP_MAX_CHANNELS 8
+#define LIVETAP_LABEL_LEN 32
+#define LIVETAP_OVERRUN -1
+#define LIVETAP_CLOSED -2
+
+// 共有メモリ先頭のヘッダ。サンプル領域は data_offset から
+// int32_t samples[num_channels][capacity] (左詰め, フルスケール = INT32_MAX) の順に並ぶ。
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;      // frames per channel (power of 2)
+    uint32_t num_channels;
+    uint32_t data_offset;   // bytes from the beginning of the segment
+    _Atomic uint32_t state; // 1: running, 0: closed by the writer
+    _Atomic uint32_t layout_seq; // odd while sample_rate/block/labels are being updated
+    uint32_t sample_rate;
+    char block[4];
+    char labels[LIVETAP_MAX_CHANNELS][LIVETAP_LABEL_LEN]; // "" if no sensor on the channel
+    _Atomic uint64_t claim_seq; // frames the writer may be overwriting up to
+    _Atomic uint64_t write_seq; // frames completely published
+} LiveTapHeader;
+
+typedef struct {
+    char name[256];
+    int fd;
+    size_t size;
+    LiveTapHeader *header;
+    int32_t *samples;
+} LiveTap;
+
+typedef struct {
+    uint32_t sample_rate;
+    char block[4];
+    char labels[LIVETAP_MAX_CHANNELS][LIVETAP_LABEL_LEN];
+} LiveTapLayout;
+
+// writer
+LiveTap *livetap_create(const char *name, int num_channels, double seconds, int sampling_rate);
+void livetap_set_layout(LiveTap *tap, int sample_rate, const char *block, const char **labels);
+void livetap_publish(LiveTap *tap, int32_t **data_buffer, int num_channels, int offset, int num_frames);
+void livetap_close(LiveTap *tap);
+
+// reader
+LiveTap *livetap_open(const char *name);
+int livetap_get_layout(LiveTap *tap, LiveTapLayout *layout);
+int livetap_read(LiveTap *tap, uint64_t *pos, int32_t **out, int max_frames);
+void livetap_detach(LiveTap *tap);
+
+#endif // LIVETAP_H
@@ -0,0 +1,260 @@
+// ライブタップのストレステスト (make test)。
+// 1つの書き込み側と複数の読み出し側をスレッドで同時に動かし、読み出したサンプルが
+// 位置から計算した値と一致すること (欠落や破損が無いこと) と、追い越された読み出し側には
+// LIVETAP_OVERRUN が報告されることを確かめる。リングの最も古い位置ばかりを読む読み出し側で、
+// コピー中に上書きされた読み出し (claim_seqでの検出) も確かめる。途中から書き込むチャンネル数を減らし、
+// 書かれないチャンネルが0になることも確かめる。ヘッダが壊れたセグメントを開かないことも確かめる。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "livetap.h"
+
+#define TEST_CHANNELS 8
+#define TEST_PARTIAL_CHANNELS 3 // -s/-bで一部のセンサーだけ取得する場合に相当
+#define TEST_CHUNK 700          // 1回に公開するフレーム数の最大 (リング長を割り切らない値)
+#define TEST_SAMPLE_RATE 4096   // リング長は1秒分 = 4096フレーム
+
+enum {
+    READER_FAST,            // 書き込み側に追従する
+    READER_SLOW,            // 読み出しを遅らせて必ず追い越されるようにする
+    READER_EDGE,            // 毎回リングの最も古い位置から読み、コピー中に上書きされるようにする
+};
+
+typedef struct {
+    const char *name;
+    int mode;
+    uint64_t frames;        // 検証したフレーム数
+    uint64_t overruns;
+    uint64_t errors;
+    uint64_t end_pos;
+} Reader;
+
+static uint64_t total_frames = 4000000;
+static uint64_t partial_from; // このフレーム以降は TEST_PARTIAL_CHANNELS チャンネルだけを書き込む
+static volatile int readers_ready;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int32_t expected_sample(uint64_t seq, int ch) {
+    if (seq >= partial_from && ch >= TEST_PARTIAL_CHANNELS) {
+        return 0;
+    }
+    return (int32_t)(uint32_t)(seq * 2654435761u + ch * 40503u + 1);
+}
+
+static void *reader_main(void *arg) {
+    Reader *r = arg;
+    int32_t *buffer[LIVETAP_MAX_CHANNELS];
+    int max_frames = r->mode == READER_SLOW ? 256 : 4096;
+
+    LiveTap *tap = livetap_open(r->name);
+    if (tap == NULL) {
+        fprintf(stderr, "Error: failed to open the live tap %s\n", r->name);
+        r->errors++;
+        return NULL;
+    }
+    for (int ch = 0; ch < LIVETAP_MAX_CHANNELS; ch++) {
+        buffer[ch] = malloc(max_frames * sizeof(int32_t));
+    }
+    uint64_t pos = atomic_load(&tap->header->write_seq);
+    pthread_mutex_lock(&ready_lock);
+    readers_ready++;
+    pthread_mutex_unlock(&ready_lock);
+
+    while (1) {
+        if (r->mode == READER_EDGE) {
+            if (atomic_load(&tap->header->state) == 0) {
+                break;
+            }
+            uint64_t written = atomic_load(&tap->header->write_seq);
+            if (written > tap->header->capacity) {
+                pos = written - tap->header->capacity + 1;
+            }
+        }
+        uint64_t before = pos;
+        int n = livetap_read(tap, &pos, buffer, max_frames);
+        if (n == LIVETAP_CLOSED) {
+            break;
+        }
+        if (n == LIVETAP_OVERRUN) {
+            r->overruns++;
+            if (pos < before) {
+                fprintf(stderr, "Error: position moved back on overrun: %llu -> %llu\n", (unsigned long long)before, (unsigned long long)pos);
+                r->errors++;
+            }
+            continue;
+        }
+        if (n == 0) {
+            usleep(100);
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            for (int ch = 0; ch < TEST_CHANNELS; ch++) {
+                if (buffer[ch][i] != expected_sample(before + i, ch)) {
+                    if (r->errors < 5) {
+                        fprintf(stderr, "Error: sample mismatch at frame %llu ch%d: %d (expected %d)\n",
+                                (unsigned long long)(before + i), ch, buffer[ch][i], expected_sample(before + i, ch));
+                    }
+                    r->errors++;
+                }
+            }
+        }
+        if (pos != before + n) {
+            fprintf(stderr, "Error: position advanced by %llu for %d frames\n", (unsigned long long)(pos - before), n);
+            r->errors++;
+        }
+        r->frames += n;
+        if (r->mode == READER_SLOW) {
+            usleep(2000);
+        }
+    }
+    r->end_pos = pos;
+
+    for (int ch = 0; ch < LIVETAP_MAX_CHANNELS; ch++) {
+        free(buffer[ch]);
+    }
+    livetap_detach(tap);
+    return NULL;
+}
+
+// 壊れたヘッダのセグメントは読み出し側が開かない (チャンネル数とリング長を、全体の大きさは変えずに書き換える)
+static int test_invalid_header(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/livetap_test.bad.%d", (int)getpid());
+    LiveTap *tap = livetap_create(name, LIVETAP_MAX_CHANNELS, 0.1, 1000);
+    if (tap == NULL) {
+        return 1;
+    }
+    struct {
+        const char *name;
+        uint32_t num_channels;
+        uint32_t capacity;
+        int valid;
+    } cases[] = {
+        { "too many channels", LIVETAP_MAX_CHANNELS * 2, 512, 0 },
+        { "no channels", 0, 1024, 0 },
+        { "capacity is not a power of 2", LIVETAP_MAX_CHANNELS, 1000, 0 },
+        { "zero capacity", LIVETAP_MAX_CHANNELS, 0, 0 },
+        { "valid", LIVETAP_MAX_CHANNELS, 1024, 1 },
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        tap->header->num_channels = cases[i].num_channels;
+        tap->header->capacity = cases[i].capacity;
+        LiveTap *reader = livetap_open(name);
+        if ((reader != NULL) != cases[i].valid) {
+            fprintf(stderr, "Error: livetap_open %s a header with %s\n", reader != NULL ? "accepted" : "rejected", cases[i].name);
+            failed = 1;
+        }
+        if (reader != NULL) {
+            livetap_detach(reader);
+        }
+    }
+    livetap_close(tap);
+    shm_unlink(name);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int num_readers = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:")) != -1) {
+        switch (opt) {
+            case 'r':
+                num_readers = atoi(optarg);
+                break;
+            case 'f':
+                total_frames = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: livetap_test [-r readers] [-f frames]\n");
+                exit(1);
+        }
+    }
+    if (num_readers < 3) {
+        num_readers = 3; // 遅い読み出し側と最も古い位置を読む読み出し側を1つずつ含める
+    }
+    partial_from = total_frames / 2;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/livetap_test.%d", (int)getpid());
+    LiveTap *tap = livetap_create(name, TEST_CHANNELS, 1.0, TEST_SAMPLE_RATE);
+    if (tap == NULL) {
+        exit(1);
+    }
+
+    Reader *readers = calloc(num_readers, sizeof(Reader));
+    pthread_t *threads = calloc(num_readers, sizeof(pthread_t));
+    for (int i = 0; i < num_readers; i++) {
+        readers[i].name = name;
+        readers[i].mode = i == 0 ? READER_SLOW : i == 1 ? READER_EDGE : READER_FAST;
+        pthread_create(&threads[i], NULL, reader_main, &readers[i]);
+    }
+    while (readers_ready < num_readers) {
+        usleep(1000);
+    }
+
+    // 書き込み側: 位置から決まる値を、長さの揃わないチャンクで公開し続ける
+    int32_t *data_buffer[TEST_CHANNELS];
+    for (int ch = 0; ch < TEST_CHANNELS; ch++) {
+        data_buffer[ch] = malloc((TEST_CHUNK + 1) * sizeof(int32_t));
+    }
+    uint64_t seq = 0;
+    int chunks = 0;
+    while (seq < total_frames) {
+        int num_frames = 1 + (int)((seq * 7919) % TEST_CHUNK);
+        if ((uint64_t)num_frames > total_frames - seq) {
+            num_frames = total_frames - seq;
+        }
+        int offset = chunks % 2; // data_bufferの途中からの公開も試す
+        int num_channels = seq >= partial_from ? TEST_PARTIAL_CHANNELS : TEST_CHANNELS;
+        for (int ch = 0; ch < num_channels; ch++) {
+            for (int i = 0; i < num_frames; i++) {
+                data_buffer[ch][offset + i] = expected_sample(seq + i, ch);
+            }
+        }
+        // チャンクの途中でチャンネル数が変わらないように切る
+        if (seq < partial_from && seq + num_frames > partial_from) {
+            num_frames = partial_from - seq;
+        }
+        livetap_publish(tap, data_buffer, num_channels, offset, num_frames);
+        seq += num_frames;
+        if (++chunks % 64 == 0) {
+            usleep(200); // 速い読み出し側が追従できる程度に間を空ける
+        }
+    }
+    livetap_close(tap);
+
+    int failed = test_invalid_header();
+    for (int i = 0; i < num_readers; i++) {
+        pthread_join(threads[i], NULL);
+        Reader *r = &readers[i];
+        printf("reader %d%s: %llu frames verified, %llu overruns, %llu errors\n", i,
+               r->mode == READER_SLOW ? " (slow)" : r->mode == READER_EDGE ? " (edge)" : "",
+               (unsigned long long)r->frames, (unsigned long long)r->overruns, (unsigned long long)r->errors);
+        if (r->errors > 0 || r->frames == 0) {
+            failed = 1;
+        }
+        if (r->mode != READER_EDGE && r->end_pos != total_frames) {
+            fprintf(stderr, "Error: reader %d stopped at %llu of %llu frames\n", i, (unsigned long long)r->end_pos, (unsigned long long)total_frames);
+            failed = 1;
+        }
+        if (r->mode != READER_FAST && r->overruns == 0) {
+            fprintf(stderr, "Error: reader %d is never reported as overrun\n", i);
+            failed = 1;
+        }
+    }
+    shm_unlink(name);
+
+    for (int ch = 0; ch < TEST_CHANNELS; ch++) {
+        free(data_buffer[ch]);
+    }
+    free(readers);
+    free(threads);
+
+    printf("livetap_test: %s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "schedule.h"
+#include "debug.h"
+
+#define SCHEDULE_NEVER 1e9          // 一度も取得していないセンサーの遅れ (最優先)
+#define SCHEDULE_OVERHEAD_WEIGHT 0.3 // オーバーヘッドの実測値を平均へ反映させる重み
+
+// 状態ファイルの形式 (1行1項目のテキスト):
+//   last_run <unix time>
+//   overhead <sec>
+//   sensor <label> <unix time of the last capture>
+void schedule_load_state(const char *path, ScheduleState *state) {
+    char line[256];
+    char label[SCHEDULE_LABEL_LEN];
+    double value;
+
+    memset(state, 0, sizeof(*state));
+    state->overhead = SCHEDULE_DEFAULT_OVERHEAD;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        DEBUG_PRINT("schedule state [%s] is not found. starting with an empty state\n", path);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "last_run %lf", &value) == 1) {
+            state->last_run = value;
+        } else if (sscanf(line, "overhead %lf", &value) == 1) {
+            if (value > 0) {
+                state->overhead = value;
+            }
+        } else if (sscanf(line, "sensor %31s %lf", label, &value) == 2) {
+            schedule_set_capture(state, label, value);
+        }
+    }
+    fclose(fp);
+}
+
+// 一時ファイルに書いてfsyncしてからrenameする (途中で落ちても前回の状態が残る)
+int schedule_save_state(const char *path, const ScheduleState *state) {
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: failed to create schedule state [%s]: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "last_run %.3f\n", state->last_run);
+    fprintf(fp, "overhead %.3f\n", state->overhead);
+    for (int i = 0; i < state->num_sensors; i++) {
+        fprintf(fp, "sensor %s %.3f\n", state->labels[i], state->last_capture[i]);
+    }
+
+    int retval = 0;
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        retval = -1;
+    }
+    if (fclose(fp) != 0) {
+        retval = -1;
+    }
+    if (retval == 0 && rename(tmp_path, path) < 0) {
+        retval = -1;
+    }
+    if (retval < 0) {
+        fprintf(stderr, "Warning: failed to save schedule state [%s]: %s\n", path, strerror(errno));
+        remove(tmp_path);
+    }
+    return retval;
+}
+
+// 前回取得した時刻を返す。一度も取得していなければ-1
+double schedule_last_capture(const ScheduleState *state, const char *label) {
+    for (int i = 0; i < state->num_sensors; i++) {
+        if (strcmp(state->labels[i], label) == 0) {
+            return state->last_capture[i];
+        }
+    }
+    return -1;
+}
+
+void schedule_set_capture(ScheduleState *state, const char *label, double t) {
+    int i;
+    for (i = 0; i < state->num_sensors; i++) {
+        if (strcmp(state->labels[i], label) == 0) {
+            break;
+        }
+    }
+    if (i == state->num_sensors) {
+        if (state->num_sensors >= SCHEDULE_MAX_SENSORS) {
+            return;
+        }
+        snprintf(state->labels[i], SCHEDULE_LABEL_LEN, "%s", label);
+        state->num_sensors++;
+    }
+    state->last_capture[i] = t;
+}
+
+void schedule_update_overhead(ScheduleState *state, double measured) {
+    if (measured > 0) {
+        state->overhead += SCHEDULE_OVERHEAD_WEIGHT * (measured - state->overhead);
+    }
+}
+
+// 優先度の高い順、同じなら遅れの大きい順、同じならブロック順
+static int compare_entries(const void *a, const void *b) {
+    const ScheduleEntry *x = a;
+    const ScheduleEntry *y = b;
+    if (x->priority != y->priority) {
+        return y->priority - x->priority;
+    }
+    if (x->urgency != y->urgency) {
+        return x->urgency < y->urgency ? 1 : -1;
+    }
+    return x->block_index - y->block_index;
+}
+
+// nowの時点で取得するブロックと取得時間を決める。
+// budget (秒, 0: 無制限) を超えるブロックは次回へ回すが、先頭のブロックは予算を超えても必ず取得する。
+void schedule_plan(const ScheduleSensor *sensors, int num_sensors, const ScheduleState *state, double now, double budget, SchedulePlan *plan) {
+    ScheduleEntry blocks[SCHEDULE_MAX_BLOCKS];
+    int due[SCHEDULE_MAX_SENSORS] = { 0 };
+    double age[SCHEDULE_MAX_SENSORS];
+
+    memset(plan, 0, sizeof(*plan));
+    memset(blocks, 0, sizeof(blocks));
+    plan->overhead = state->overhead;
+
+    // 実行は一定間隔で起動されるので、周期ちょうどを待つと毎回最大1間隔分遅れる。
+    // 前回の実行からの間隔の半分までは早めに取得して、平均の間隔を周期に合わせる
+    double interval = 0.0;
+    if (state->last_run > 0 && now > state->last_run) {
+        interval = now - state->last_run;
+    }
+    double tolerance = interval / 2;
+    int every_run[SCHEDULE_MAX_BLOCKS] = { 0 };
+
+    if (num_sensors > SCHEDULE_MAX_SENSORS) {
+        num_sensors = SCHEDULE_MAX_SENSORS;
+    }
+    for (int i = 0; i < num_sensors; i++) {
+        const ScheduleSensor *s = &sensors[i];
+        if (!s->candidate) {
+            continue;
+        }
+        double last = schedule_last_capture(state, s->label);
+        age[i] = last < 0 ? -1 : now - last;
+        due[i] = s->forced || last < 0 || s->cadence <= 0 || age[i] >= s->cadence - tolerance;
+        if (!due[i]) {
+            continue;
+        }
+
+        ScheduleEntry *e = &blocks[s->block_index];
+        double urgency = (last < 0 || s->forced) ? SCHEDULE_NEVER : s->cadence > 0 ? age[i] / s->cadence : 1.0;
+        if (e->num_due == 0 || s->priority > e->priority) {
+            e->priority = s->priority;
+        }
+        if (urgency > e->urgency) {
+            e->urgency = urgency;
+        }
+        if (s->duration > e->window) {
+            e->window = s->duration;
+        }
+        e->block_index = s->block_index;
+        e->block = s->block;
+        e->sensors[i] = 1;
+        e->num_due++;
+        if (s->cadence - tolerance <= interval) {
+            every_run[s->block_index] = 1;
+        }
+    }
+
+    // 次回の実行で取得が必要になるセンサーは、そのブロックが次回も起動されるのでなければ今回前倒しで取得する。
+    // 窓を延ばす時間は、次回ブロックを起動し直す時間 (オーバーヘッド + 取得時間) より必ず短い
+    for (int i = 0; i < num_sensors; i++) {
+        const ScheduleSensor *s = &sensors[i];
+        if (!s->candidate || due[i] || interval <= 0 || blocks[s->block_index].num_due == 0 || every_run[s->block_index]) {
+            continue;
+        }
+        ScheduleEntry *e = &blocks[s->block_index];
+        if (age[i] + interval >= s->cadence - tolerance) {
+            if (s->duration > e->window) {
+                e->window = s->duration;
+            }
+            e->sensors[i] = 1;
+            e->num_early++;
+        }
+    }
+
+    for (int b = 0; b < SCHEDULE_MAX_BLOCKS; b++) {
+        if (blocks[b].num_due > 0) {
+            blocks[b].cost = blocks[b].window + plan->overhead;
+            plan->entries[plan->num_entries++] = blocks[b];
+        }
+    }
+    qsort(plan->entries, plan->num_entries, sizeof(ScheduleEntry), compare_entries);
+
+    // 予算に収まるブロックだけを残す (収まらないブロックは飛ばして、より短いブロックを詰める)
+    int kept = 0;
+    for (int k = 0; k < plan->num_entries; k++) {
+        ScheduleEntry *e = &plan->entries[k];
+        if (budget > 0 && kept > 0 && plan->total + e->cost > budget) {
+            for (int i = 0; i < num_sensors; i++) {
+                if (e->sensors[i] && due[i]) {
+                    plan->deferred[i] = 1;
+                    plan->num_deferred++;
+                }
+            }
+            continue;
+        }
+        e->start = plan->total;
+        plan->total += e->cost;
+        plan->entries[kept++] = *e;
+    }
+    plan->num_entries = kept;
+}
+
+void schedule_print_plan(FILE *fp, const SchedulePlan *plan, const ScheduleSensor *sensors, int num_sensors) {
+    for (int k = 0; k < plan->num_entries; k++) {
+        const ScheduleEntry *e = &plan->entries[k];
+        fprintf(fp, "plan: block %s at +%.1f sec for %.1f sec (priority %d):", e->block, e->start, e->window, e->priority);
+        for (int i = 0; i < num_sensors; i++) {
+            if (e->sensors[i]) {
+                fprintf(fp, " %s", sensors[i].label);
+            }
+        }
+        if (e->num_early > 0) {
+            fprintf(fp, " (%d early)", e->num_early);
+        }
+        fputc('\n', fp);
+    }
+    if (plan->num_deferred > 0) {
+        fprintf(fp, "plan: deferred to the next run (cycle_budget):");
+        for (int i = 0; i < num_sensors; i++) {
+            if (plan->deferred[i]) {
+                fprintf(fp, " %s", sensors[i].label);
+            }
+        }
+        fputc('\n', fp);
+    }
+    fprintf(fp, "plan: %d blocks, %.1f sec of AFE time (overhead %.2f sec/block)\n", plan->num_entries, plan->total, plan->overhead);
+}
@@ -0,0 +1,71 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+// センサー毎の取得スケジューラ。
+// センサー毎の周期 (cadence)・取得時間 (duration)・優先度 (priority) と、前回取得した時刻 (状態ファイル) から、
+// その回に取得が必要なセンサーを決め、それを含むブロックだけを優先度順に起動する計画を立てる。
+// ブロックの起動・停止のオーバーヘッドはブロック毎に掛かるので、同じブロックのセンサーは1回の起動でまとめて取得し、
+// 取得時間はブロック内で最も長いものに合わせる。次回の実行で取得が必要になるセンサーは前倒しで一緒に取得し、
+// 次回同じブロックを起動し直さずに済むようにする。AFEには触れないので、シミュレーションにもそのまま使う。
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SCHEDULE_MAX_SENSORS 32 // emgetdataのMAX_SENSORSと同じ
+#define SCHEDULE_MAX_BLOCKS 8   // emgetdataのNUM_BLOCKSと同じ
+#define SCHEDULE_LABEL_LEN 32
+#define SCHEDULE_DEFAULT_OVERHEAD 3.0 // ブロック毎のstart/読み捨て/stopの初期見積もり (秒)。以後は実測値で更新する
+
+// 計画の入力 (configのセンサー1つ分)
+typedef struct {
+    const char *label;
+    const char *block;
+    int block_index;    // 0..SCHEDULE_MAX_BLOCKS-1
+    double cadence;     // 取得間隔 (秒)。0なら毎回取得する
+    double duration;    // 最低限必要な取得時間 (秒)
+    int priority;       // 大きいほど先に、予算が足りない場合も優先して取得する
+    int candidate;      // -s/-bで選ばれている (指定が無ければ全センサー)。0ならblock_indexは見ない
+    int forced;         // -s/-bで明示的に指定された (周期に関係なく取得する)
+} ScheduleSensor;
+
+// 計画したブロック1つ分
+typedef struct {
+    int block_index;
+    const char *block;
+    double start;       // 実行開始からの予定時刻 (秒)
+    double window;      // 取得時間 (秒)
+    double cost;        // window + オーバーヘッド
+    int priority;
+    double urgency;     // 最も遅れているセンサーの (経過時間 / 周期)
+    int sensors[SCHEDULE_MAX_SENSORS]; // 1: このブロックで取得する
+    int num_due;
+    int num_early;      // 前倒しで取得するセンサー
+} ScheduleEntry;
+
+typedef struct {
+    ScheduleEntry entries[SCHEDULE_MAX_BLOCKS];
+    int num_entries;
+    double total;       // 計画したAFEの使用時間 (秒)
+    double overhead;    // 計画に使ったブロック毎のオーバーヘッド (秒)
+    int deferred[SCHEDULE_MAX_SENSORS]; // 取得が必要だが予算が足りず次回へ回したセンサー
+    int num_deferred;
+} SchedulePlan;
+
+// 状態ファイルの内容
+typedef struct {
+    char labels[SCHEDULE_MAX_SENSORS][SCHEDULE_LABEL_LEN];
+    double last_capture[SCHEDULE_MAX_SENSORS]; // unix time
+    int num_sensors;
+    double last_run;    // 前回の実行時刻 (unix time, 0: 無し)
+    double overhead;    // ブロック毎のオーバーヘッドの実測値 (指数移動平均)
+} ScheduleState;
+
+void schedule_load_state(const char *path, ScheduleState *state);
+int schedule_save_state(const char *path, const ScheduleState *state);
+double schedule_last_capture(const ScheduleState *state, const char *label);
+void schedule_set_capture(ScheduleState *state, const char *label, double t);
+void schedule_update_overhead(ScheduleState *state, double measured);
+void schedule_plan(const ScheduleSensor *sensors, int num_sensors, const ScheduleState *state, double now, double budget, SchedulePlan *plan);
+void schedule_print_plan(FILE *fp, const SchedulePlan *plan, const ScheduleSensor *sensors, int num_sensors);
+
+#endif // SCHEDULE_H
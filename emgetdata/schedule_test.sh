@@ -0,0 +1,135 @@
+#!/bin/bash
+# スケジューラの試験 (make test)。
+# afesimに対して schedule: true のemgetdataを何回か実行し、schedule.csv・schedule.state・サンプルストアから、
+# - cycle_budget に収まらないブロックが次回へ回され、優先度順に1回1ブロックずつ取得されること
+# - 前回取得した時刻が schedule.state に保存され、次の実行で周期 (cadence) を過ぎていないセンサーを取得しないこと
+# - schedule.state の時刻が周期を過ぎると、そのセンサーだけが再び取得されること
+# を確かめる。周期は1時間とし、時間の経過は schedule.state の時刻を書き換えて作る (待たずに決まった結果になる)。
+
+cd "$(dirname "$0")"
+BIN_DIR=$(pwd)
+WORK_DIR=$(mktemp -d)
+PORT=$((40000 + ($$ + 5000) % 10000))
+SAMPLING_RATE=20000
+WINDOW=0.5
+CADENCE=3600
+BUDGET=0.6 # 1ブロック (取得時間 + オーバーヘッド) は必ず超え、2ブロックは収まらない
+
+afesim_pid=""
+trap 'if [ -n "$afesim_pid" ]; then kill $afesim_pid 2>/dev/null; fi; rm -rf "$WORK_DIR"' EXIT
+
+failed=0
+
+fail() {
+    echo "FAILED: $*" 1>&2
+    failed=1
+}
+
+# 関数: emgetdataを1回実行し、schedule.csvに追加された行のブロックを空白区切りで返す
+run_emgetdata() {
+    local before=0
+    if [ -f "${WORK_DIR}/schedule.csv" ]; then
+        before=$(wc -l < "${WORK_DIR}/schedule.csv")
+    fi
+    (cd "$WORK_DIR" && "${BIN_DIR}/emgetdata" -f config.yml) >> "${WORK_DIR}/emgetdata.log" 2>&1 || fail "emgetdata exited with $?"
+    tail -n +$((before + 1)) "${WORK_DIR}/schedule.csv" | awk -F, '$1 != "run" { printf "%s%s", sep, $2; sep = " " }'
+}
+
+# 関数: schedule.stateに記録されたセンサーの前回取得時刻を返す (無ければ空)
+last_capture() {
+    awk -v label=$1 '$1 == "sensor" && $2 == label { print $3 }' "${WORK_DIR}/schedule.state"
+}
+
+# 関数: 1回の実行で取得されたブロックを確かめる
+# 引数: 実行の番号, 取得されたブロック, 期待するブロック
+expect_blocks() {
+    echo "run $1: captured [$2] (expected [$3])"
+    if [ "$2" != "$3" ]; then
+        fail "run $1: captured [$2] (expected [$3])"
+    fi
+}
+
+{
+    echo "afe_ip: 127.0.0.1"
+    echo "afe_port: ${PORT}"
+    echo "sensors:"
+    echo "  - {label: \"A1\", block: \"A\", channel: \"1\", gain: 100, cadence: ${CADENCE}, duration: ${WINDOW}, priority: 3}"
+    echo "  - {label: \"B1\", block: \"B\", channel: \"1\", gain: 100, cadence: ${CADENCE}, duration: ${WINDOW}, priority: 2}"
+    echo "  - {label: \"C1\", block: \"C\", channel: \"1\", gain: 100, cadence: ${CADENCE}, duration: ${WINDOW}, priority: 1}"
+    echo "sampling_rate: ${SAMPLING_RATE}"
+    echo "afe_format: \"4ch16bit\""
+    echo "output: \"store\""
+    echo "sample_store: \"${WORK_DIR}/store\""
+    echo "rawdata_dir: \"${WORK_DIR}/rawdata\""
+    echo "schedule: true"
+    echo "cycle_budget: ${BUDGET}"
+} > "${WORK_DIR}/config.yml"
+
+"${BIN_DIR}/afesim" -p $PORT -F 4ch16bit 2> "${WORK_DIR}/afesim.log" &
+afesim_pid=$!
+sleep 0.3
+
+# 1回目: 状態ファイルが無いので全センサーが対象。予算に収まるのは優先度の最も高いAだけ
+blocks=$(run_emgetdata)
+expect_blocks 1 "$blocks" "A"
+if ! grep -q "deferred to the next run (cycle_budget): B1 C1" "${WORK_DIR}/emgetdata.log"; then
+    fail "run 1: B1 and C1 are not reported as deferred"
+fi
+a1_time=$(last_capture A1)
+if [ -z "$a1_time" ] || [ -n "$(last_capture B1)" ] || [ -n "$(last_capture C1)" ]; then
+    fail "run 1: schedule.state has A1=[${a1_time}] B1=[$(last_capture B1)] C1=[$(last_capture C1)] (expected only A1)"
+fi
+if [ -z "$(awk '$1 == "last_run" && $2 > 0' "${WORK_DIR}/schedule.state")" ]; then
+    fail "run 1: last_run is not saved"
+fi
+if grep -q "^overhead 3.000$" "${WORK_DIR}/schedule.state"; then
+    fail "run 1: the measured overhead is not saved"
+fi
+
+# 2回目、3回目: Aは周期内なので取得せず、回されたB、Cを優先度順に1つずつ取得する
+blocks=$(run_emgetdata)
+expect_blocks 2 "$blocks" "B"
+blocks=$(run_emgetdata)
+expect_blocks 3 "$blocks" "C"
+if [ "$(last_capture A1)" != "$a1_time" ]; then
+    fail "run 3: A1 is captured again within its cadence ($(last_capture A1) != ${a1_time})"
+fi
+
+# 4回目: 全センサーが周期内なので何も取得しない
+blocks=$(run_emgetdata)
+expect_blocks 4 "$blocks" ""
+
+# 5回目: A1の前回取得時刻を周期より前にずらすと、A1だけを取得する
+b1_time=$(last_capture B1)
+awk -v c=$CADENCE '$1 == "sensor" && $2 == "A1" { $3 = sprintf("%.3f", $3 - c - 1) } { print }' "${WORK_DIR}/schedule.state" > "${WORK_DIR}/schedule.state.new"
+mv "${WORK_DIR}/schedule.state.new" "${WORK_DIR}/schedule.state"
+blocks=$(run_emgetdata)
+expect_blocks 5 "$blocks" "A"
+if ! awk -v a=$(last_capture A1) -v p=$a1_time 'BEGIN { exit !(a > p) }'; then
+    fail "run 5: A1 capture time is not updated"
+fi
+if [ "$(last_capture B1)" != "$b1_time" ]; then
+    fail "run 5: B1 is captured again within its cadence"
+fi
+
+kill $afesim_pid 2>/dev/null
+wait $afesim_pid 2>/dev/null
+afesim_pid=""
+
+# 実際にストアへ書かれたサンプル数: A1は2回、B1とC1は1回
+for sensor in A1:2 B1:1 C1:1; do
+    label=${sensor%%:*}
+    expected=$(awk -v n=${sensor##*:} -v d=$WINDOW -v r=$SAMPLING_RATE 'BEGIN { printf "%d", n * d * r }')
+    samples=$("${BIN_DIR}/emstore" -d "${WORK_DIR}/store" -s $label -S 2> /dev/null | awk -F, '{ n += $2 } END { printf "%d", n }')
+    echo "${label}: ${samples} samples in the store (expected ${expected})"
+    if [ "$samples" != "$expected" ]; then
+        fail "${label}: ${samples} samples in the store (expected ${expected})"
+    fi
+done
+
+if [ $failed -ne 0 ]; then
+    cat "${WORK_DIR}/emgetdata.log" 1>&2
+    echo "schedule_test: FAILED"
+    exit 1
+fi
+echo "schedule_test: OK"
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "storage.h"
+#include "debug.h"
+
+#define STORAGE_MAGIC "EMIDX1"
+#define STORAGE_FS_MARGIN (16LL * 1024 * 1024) // ファイルシステムに最低限残しておく空き容量
+
+// check_wav_effectivenessが無効データに付ける拡張子
+static const char *noneffective_suffixes[] = { "weak", "unstable", "clipped", "abnormal", "unavailable" };
+
+static off_t record_offset(uint64_t record) {
+    return sizeof(StorageIndexHeader) + (off_t)record * sizeof(StorageRecord);
+}
+
+// インデックスを排他ロックしてヘッダを読み直す (複数のemgetdataが同時に動いても壊れないように)
+static void storage_lock(StorageManager *sm) {
+    flock(sm->fd, LOCK_EX);
+    if (pread(sm->fd, &sm->header, sizeof(sm->header), 0) != sizeof(sm->header)) {
+        memset(&sm->header, 0, sizeof(sm->header));
+        memcpy(sm->header.magic, STORAGE_MAGIC, sizeof(STORAGE_MAGIC));
+    }
+    // 前回レコード追記後にヘッダを書く前に落ちていた場合はファイル長を正とする
+    struct stat st;
+    if (fstat(sm->fd, &st) == 0 && st.st_size >= (off_t)sizeof(StorageIndexHeader)) {
+        sm->header.count = (st.st_size - sizeof(StorageIndexHeader)) / sizeof(StorageRecord);
+    }
+    if (sm->header.head > sm->header.count) {
+        sm->header.head = sm->header.count;
+    }
+    if (sm->header.scan < sm->header.head) {
+        sm->header.scan = sm->header.head;
+    }
+    if (sm->header.scan > sm->header.count) {
+        sm->header.scan = sm->header.count;
+    }
+}
+
+static void storage_unlock(StorageManager *sm) {
+    if (pwrite(sm->fd, &sm->header, sizeof(sm->header), 0) != sizeof(sm->header)) {
+        perror("storage: pwrite (header)");
+    }
+    flock(sm->fd, LOCK_UN);
+}
+
+static int read_record(StorageManager *sm, uint64_t record, StorageRecord *rec) {
+    return pread(sm->fd, rec, sizeof(*rec), record_offset(record)) == sizeof(*rec) ? 0 : -1;
+}
+
+static void write_record(StorageManager *sm, uint64_t record, StorageRecord *rec) {
+    if (pwrite(sm->fd, rec, sizeof(*rec), record_offset(record)) != sizeof(*rec)) {
+        perror("storage: pwrite (record)");
+    }
+}
+
+StorageManager *storage_open(const char *index_path, int64_t budget_bytes, int high_percent, int low_percent,
+                             const char *rawdata_dir, const char *noneffective_dir) {
+    if (low_percent > high_percent) {
+        fprintf(stderr, "Error: disk_low_watermark must not be larger than disk_high_watermark\n");
+        return NULL;
+    }
+
+    StorageManager *sm = calloc(1, sizeof(StorageManager));
+    sm->fd = open(index_path, O_RDWR | O_CREAT, 0644);
+    if (sm->fd < 0) {
+        fprintf(stderr, "Error: failed to open storage index [%s]: %s\n", index_path, strerror(errno));
+        free(sm);
+        return NULL;
+    }
+    sm->budget_bytes = budget_bytes;
+    sm->high_bytes = budget_bytes / 100 * high_percent;
+    sm->low_bytes = budget_bytes / 100 * low_percent;
+    snprintf(sm->rawdata_dir, sizeof(sm->rawdata_dir), "%s", rawdata_dir);
+    snprintf(sm->noneffective_dir, sizeof(sm->noneffective_dir), "%s", noneffective_dir);
+
+    storage_lock(sm);
+    if (memcmp(sm->header.magic, STORAGE_MAGIC, sizeof(STORAGE_MAGIC)) != 0) {
+        fprintf(stderr, "Error: [%s] is not a storage index\n", index_path);
+        flock(sm->fd, LOCK_UN);
+        close(sm->fd);
+        free(sm);
+        return NULL;
+    }
+    storage_unlock(sm);
+
+    DEBUG_PRINT("storage: index %s, %lld/%lld bytes used, %llu records from %llu\n", index_path,
+        (long long)sm->header.live_bytes, (long long)budget_bytes,
+        (unsigned long long)sm->header.count, (unsigned long long)sm->header.head);
+    return sm;
+}
+
+// レコードのファイルの現在の状態を調べ、解放できるものは解放してEVICTEDにする。
+// アップロード待ちのもの(元の場所かrawdata_dirに残っているもの)と書き込み中のものはそのまま残す。
+static void try_evict(StorageManager *sm, uint64_t record, StorageRecord *rec) {
+    struct stat st;
+
+    if (rec->state == STORAGE_EVICTED) {
+        return;
+    }
+    if (rec->state == STORAGE_WRITING) {
+        // 書き込み中のファイルには触れない。書き込んだプロセスが死んでいれば書き込み済みとして扱う
+        if (rec->pid == getpid() || kill(rec->pid, 0) == 0 || errno != ESRCH) {
+            return;
+        }
+        if (stat(rec->path, &st) == 0) {
+            rec->bytes = st.st_size;
+            rec->state = STORAGE_LIVE;
+            sm->header.live_bytes += rec->bytes;
+            write_record(sm, record, rec);
+            return;
+        }
+    }
+
+    char *base = strrchr(rec->path, '/') != NULL ? strrchr(rec->path, '/') + 1 : rec->path;
+    char candidate[STORAGE_PATH_LEN * 2 + 32];
+
+    if (stat(rec->path, &st) == 0) {
+        return; // pending
+    }
+    snprintf(candidate, sizeof(candidate), "%s/%s", sm->rawdata_dir, base);
+    if (sm->rawdata_dir[0] != '\0' && stat(candidate, &st) == 0 && st.st_size > 0) {
+        return; // pending upload
+    }
+
+    // 無効データとして移動されたものを削除する
+    char stem[STORAGE_PATH_LEN];
+    snprintf(stem, sizeof(stem), "%s", base);
+    char *ext = strrchr(stem, '.');
+    if (ext != NULL) {
+        *ext = '\0';
+    }
+    if (sm->noneffective_dir[0] != '\0') {
+        for (unsigned int i = 0; i < sizeof(noneffective_suffixes) / sizeof(char *); i++) {
+            snprintf(candidate, sizeof(candidate), "%s/%s.%s.wav", sm->noneffective_dir, stem, noneffective_suffixes[i]);
+            if (unlink(candidate) == 0) {
+                fprintf(stderr, "storage: evicted non-effective capture [%s]\n", candidate);
+                break;
+            }
+        }
+    }
+
+    // ここまで来たものはアップロード済みか、今削除した無効データ
+    sm->header.live_bytes -= rec->bytes;
+    if (sm->header.live_bytes < 0) {
+        sm->header.live_bytes = 0;
+    }
+    rec->state = STORAGE_EVICTED;
+    write_record(sm, record, rec);
+}
+
+static int64_t fs_available(const char *dir) {
+    struct statvfs vfs;
+    if (statvfs(dir, &vfs) < 0) {
+        return INT64_MAX;
+    }
+    return (int64_t)vfs.f_bavail * vfs.f_frsize - STORAGE_FS_MARGIN;
+}
+
+static int reserved_enough(StorageManager *sm, int64_t bytes) {
+    return sm->header.live_bytes + bytes <= sm->low_bytes && fs_available(".") >= bytes;
+}
+
+// bytesを書き込む余地を確保する。high watermarkを超える場合は古いものから解放して
+// low watermarkまで下げる。確保できれば0、できなければ-1を返す。
+int storage_reserve(StorageManager *sm, int64_t bytes) {
+    int retval = 0;
+
+    storage_lock(sm);
+    if (sm->header.live_bytes + bytes > sm->high_bytes || fs_available(".") < bytes) {
+        DEBUG_PRINT("storage: %lld bytes used, %lld bytes requested. evicting from %llu (checked up to %llu)...\n", (long long)sm->header.live_bytes,
+                    (long long)bytes, (unsigned long long)sm->header.head, (unsigned long long)sm->header.scan);
+        StorageRecord rec;
+        // 順番を外れてアップロードされたものを拾うため、一定時間毎に全体を調べ直す
+        time_t now = time(NULL);
+        if (now - sm->header.rescanned >= STORAGE_RESCAN_SECONDS || now < sm->header.rescanned) {
+            sm->header.scan = sm->header.head;
+            sm->header.rescanned = now;
+        }
+        // 前回アップロード待ちだったレコードは、先頭から解放できる間だけ調べ直す
+        for (uint64_t i = sm->header.head; i < sm->header.scan && !reserved_enough(sm, bytes); i++) {
+            if (read_record(sm, i, &rec) < 0) {
+                break;
+            }
+            try_evict(sm, i, &rec);
+            if (rec.state != STORAGE_EVICTED) {
+                break;
+            }
+        }
+        // 続きから古い順に走査し、低水位まで下がるかファイルシステムに空きができたら止める
+        for (uint64_t i = sm->header.scan; i < sm->header.count && !reserved_enough(sm, bytes); i++) {
+            if (read_record(sm, i, &rec) < 0) {
+                break;
+            }
+            try_evict(sm, i, &rec);
+            sm->header.scan = i + 1;
+        }
+        if (sm->header.live_bytes + bytes > sm->high_bytes || fs_available(".") < bytes) {
+            retval = -1;
+        }
+    }
+
+    // 先頭から連続するEVICTEDを読み飛ばせるようにheadを進めておく
+    StorageRecord rec;
+    while (sm->header.head < sm->header.count && read_record(sm, sm->header.head, &rec) == 0 && rec.state == STORAGE_EVICTED) {
+        sm->header.head++;
+    }
+    storage_unlock(sm);
+    return retval;
+}
+
+// これから書き込むファイルを登録し、レコード番号を返す
+int64_t storage_begin(StorageManager *sm, const char *path) {
+    StorageRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.created = time(NULL);
+    rec.state = STORAGE_WRITING;
+    rec.pid = getpid();
+    if (path[0] == '/') {
+        snprintf(rec.path, sizeof(rec.path), "%s", path);
+    } else {
+        char cwd[STORAGE_PATH_LEN];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            cwd[0] = '\0';
+        }
+        if ((size_t)snprintf(rec.path, sizeof(rec.path), "%s/%s", cwd, path) >= sizeof(rec.path)) {
+            fprintf(stderr, "Warning: storage: path is too long to be indexed [%s]\n", path);
+            return -1;
+        }
+    }
+
+    storage_lock(sm);
+    int64_t record = sm->header.count;
+    write_record(sm, record, &rec);
+    sm->header.count++;
+    storage_unlock(sm);
+    return record;
+}
+
+// 書き込みが完了したファイルのサイズを確定させる
+void storage_commit(StorageManager *sm, int64_t record) {
+    StorageRecord rec;
+    struct stat st;
+
+    if (record < 0) {
+        return;
+    }
+    storage_lock(sm);
+    if (read_record(sm, record, &rec) == 0 && rec.state == STORAGE_WRITING) {
+        rec.bytes = stat(rec.path, &st) == 0 ? st.st_size : 0;
+        rec.state = STORAGE_LIVE;
+        sm->header.live_bytes += rec.bytes;
+        write_record(sm, record, &rec);
+    }
+    storage_unlock(sm);
+}
+
+// 書き込みを中止して削除したファイルのレコードを無効にする
+void storage_abort(StorageManager *sm, int64_t record) {
+    StorageRecord rec;
+
+    if (record < 0) {
+        return;
+    }
+    storage_lock(sm);
+    if (read_record(sm, record, &rec) == 0 && rec.state == STORAGE_WRITING) {
+        rec.state = STORAGE_EVICTED;
+        write_record(sm, record, &rec);
+    }
+    storage_unlock(sm);
+}
+
+void storage_close(StorageManager *sm) {
+    if (sm == NULL) {
+        return;
+    }
+    close(sm->fd);
+    free(sm);
+}
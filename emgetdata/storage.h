@@ -0,0 +1,60 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// ディスク予算に基づく出力ファイルの管理。
+// emgetdataが作成したファイルを古い順にインデックスファイル(固定長レコード)へ追記しておき、
+// 予算のhigh watermarkを超えそうな場合は、アップロード済み(ローカルから消えている)または
+// 無効データ(rawdata.non-effectiveへ移動されたもの)を古い順に解放してlow watermarkまで下げる。
+// 書き込み中のファイルとアップロード待ちのファイルには触れない。
+// 一度調べてアップロード待ちだったレコードはヘッダのscanより前に残し、次からは調べ直さない。
+// アップロードはおおむね古い順に進むので、次の実行では先頭から解放できる間だけ調べ直し、その後はscan以降の
+// 新しいレコードだけを調べる。順番を外れてアップロードされたものは STORAGE_RESCAN_SECONDS 毎の全体の
+// 調べ直しで解放する。アップロードの失敗が続いても、1回の実行でstatするのは新しいレコードと解放したレコードの数程度で済む。
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STORAGE_PATH_LEN 232
+#define STORAGE_RESCAN_SECONDS 3600 // アップロード待ちだったレコードを全て調べ直す間隔
+
+#define STORAGE_LIVE 0
+#define STORAGE_EVICTED 1
+#define STORAGE_WRITING 2
+
+typedef struct {
+    char magic[8];
+    uint64_t head;       // index of the oldest record which may still hold data
+    uint64_t count;      // number of records
+    int64_t live_bytes;  // total bytes of LIVE and WRITING records
+    uint64_t scan;       // records in [head, scan) were pending when they were checked last
+    int64_t rescanned;   // unix time of the last full rescan from head
+    char reserved[16];
+} StorageIndexHeader;
+
+typedef struct {
+    int64_t created;
+    int64_t bytes;
+    int32_t state;
+    int32_t pid;
+    char path[STORAGE_PATH_LEN];
+} StorageRecord;
+
+typedef struct {
+    int fd;
+    StorageIndexHeader header;
+    int64_t budget_bytes;
+    int64_t high_bytes;
+    int64_t low_bytes;
+    char rawdata_dir[STORAGE_PATH_LEN];
+    char noneffective_dir[STORAGE_PATH_LEN];
+} StorageManager;
+
+StorageManager *storage_open(const char *index_path, int64_t budget_bytes, int high_percent, int low_percent,
+                             const char *rawdata_dir, const char *noneffective_dir);
+int storage_reserve(StorageManager *sm, int64_t bytes);
+int64_t storage_begin(StorageManager *sm, const char *path);
+void storage_commit(StorageManager *sm, int64_t record);
+void storage_abort(StorageManager *sm, int64_t record);
+void storage_close(StorageManager *sm);
+
+#endif // STORAGE_H
@@ -0,0 +1,190 @@
+// ディスク予算の管理 (storage.c) のテスト (make test)。
+// アップロードされないファイルで予算を超えた状態でstorage_reserveを繰り返し (実行毎にstorage_openし直す)、
+// - アップロード待ちのレコードは次の実行で調べ直さないこと (statの回数が新しいレコードと解放したレコードの数程度であること)
+// - 古い順にアップロードされたものは次の実行で解放されること
+// - 順番を外れてアップロードされたものは STORAGE_RESCAN_SECONDS 毎の全体の調べ直しで解放されること
+// を確かめる。statは -Wl,--wrap=stat で数える。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "storage.h"
+
+#define NUM_FILES 100
+#define NUM_UPLOADED 10
+#define NUM_NEW 5
+#define FILE_BYTES 1000
+#define BUDGET_BYTES (NUM_FILES * FILE_BYTES / 2) // アップロード待ちのファイルだけで予算を超える
+
+static char dir[256];
+static char index_path[512];
+static char rawdata_dir[512];
+static int failed = 0;
+static int stat_calls = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAILED (line %d): ", __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            failed = 1; \
+        } \
+    } while (0)
+
+int __real_stat(const char *path, struct stat *st);
+
+int __wrap_stat(const char *path, struct stat *st) {
+    stat_calls++;
+    return __real_stat(path, st);
+}
+
+static void file_path(char *path, size_t size, int n) {
+    snprintf(path, size, "%s/%03d.wav", dir, n);
+}
+
+static void create_file(int n) {
+    char path[512];
+    char data[FILE_BYTES];
+    memset(data, 0, sizeof(data));
+    file_path(path, sizeof(path), n);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(data, 1, sizeof(data), fp) != sizeof(data)) {
+        perror(path);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+// アップロードされてローカルから消えたことにする
+static void upload_file(int n) {
+    char path[512];
+    file_path(path, sizeof(path), n);
+    unlink(path);
+}
+
+static StorageManager *open_storage(void) {
+    StorageManager *sm = storage_open(index_path, BUDGET_BYTES, 90, 80, rawdata_dir, "");
+    if (sm == NULL) {
+        exit(1);
+    }
+    return sm;
+}
+
+static void add_files(int from, int to) {
+    StorageManager *sm = open_storage();
+    for (int n = from; n < to; n++) {
+        char path[512];
+        file_path(path, sizeof(path), n);
+        create_file(n);
+        storage_commit(sm, storage_begin(sm, path));
+    }
+    storage_close(sm);
+}
+
+static StorageIndexHeader read_header(void) {
+    StorageIndexHeader header;
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        perror(index_path);
+        exit(1);
+    }
+    close(fd);
+    return header;
+}
+
+static void write_header(const StorageIndexHeader *header) {
+    int fd = open(index_path, O_WRONLY);
+    if (fd < 0 || pwrite(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header)) {
+        perror(index_path);
+        exit(1);
+    }
+    close(fd);
+}
+
+// 1回の実行 (storage_openからstorage_closeまで) で1ファイル分を予約し、storage_reserveのstatの回数を返す
+static int run_reserve(const char *name) {
+    StorageManager *sm = open_storage();
+    stat_calls = 0;
+    int retval = storage_reserve(sm, FILE_BYTES);
+    int calls = stat_calls;
+    storage_close(sm);
+    StorageIndexHeader header = read_header();
+    printf("%s: reserve %s, %d stat calls, %lld bytes live, head %llu, scan %llu/%llu\n", name, retval == 0 ? "ok" : "failed", calls,
+           (long long)header.live_bytes, (unsigned long long)header.head, (unsigned long long)header.scan, (unsigned long long)header.count);
+    return calls;
+}
+
+int main(void) {
+    snprintf(dir, sizeof(dir), "/tmp/storage_test.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(index_path, sizeof(index_path), "%s/storage.idx", dir);
+    snprintf(rawdata_dir, sizeof(rawdata_dir), "%s/rawdata", dir);
+    mkdir(rawdata_dir, 0755);
+
+    add_files(0, NUM_FILES);
+    int64_t live = (int64_t)NUM_FILES * FILE_BYTES;
+    CHECK(read_header().live_bytes == live, "live_bytes %lld after adding %d files", (long long)read_header().live_bytes, NUM_FILES);
+
+    // 1回目: 全てのレコードを調べる
+    int calls = run_reserve("run 1");
+    CHECK(calls >= NUM_FILES, "run 1: %d stat calls (expected at least %d)", calls, NUM_FILES);
+    CHECK(read_header().scan == NUM_FILES, "run 1: scan is %llu (expected %d)", (unsigned long long)read_header().scan, NUM_FILES);
+
+    // 2回目: 何もアップロードされていなければ、先頭を1つ調べるだけで終わる
+    calls = run_reserve("run 2");
+    CHECK(calls <= 2, "run 2: %d stat calls for pending records checked in run 1", calls);
+    CHECK(read_header().live_bytes == live, "run 2: live_bytes changed");
+
+    // 3回目: 古い順にアップロードされたものは解放される
+    for (int n = 0; n < NUM_UPLOADED; n++) {
+        upload_file(n);
+    }
+    calls = run_reserve("run 3");
+    live -= (int64_t)NUM_UPLOADED * FILE_BYTES;
+    CHECK(read_header().live_bytes == live, "run 3: live_bytes %lld (expected %lld)", (long long)read_header().live_bytes, (long long)live);
+    CHECK(read_header().head == NUM_UPLOADED, "run 3: head is %llu (expected %d)", (unsigned long long)read_header().head, NUM_UPLOADED);
+    CHECK(calls <= NUM_UPLOADED * 2 + 2, "run 3: %d stat calls to evict %d records", calls, NUM_UPLOADED);
+
+    // 4回目: 順番を外れてアップロードされたものは、全体を調べ直すまで解放されない
+    upload_file(NUM_FILES / 2);
+    calls = run_reserve("run 4");
+    CHECK(calls <= 2, "run 4: %d stat calls", calls);
+    CHECK(read_header().live_bytes == live, "run 4: live_bytes changed before the rescan");
+
+    // 5回目: 前回の全体の調べ直しから STORAGE_RESCAN_SECONDS 経つと、全体を調べ直して解放する
+    StorageIndexHeader header = read_header();
+    header.rescanned = time(NULL) - STORAGE_RESCAN_SECONDS;
+    write_header(&header);
+    calls = run_reserve("run 5");
+    live -= FILE_BYTES;
+    CHECK(read_header().live_bytes == live, "run 5: live_bytes %lld (expected %lld)", (long long)read_header().live_bytes, (long long)live);
+    CHECK(calls >= NUM_FILES - NUM_UPLOADED, "run 5: %d stat calls (expected a full rescan)", calls);
+
+    // 6回目: 新しいレコードだけを調べる
+    add_files(NUM_FILES, NUM_FILES + NUM_NEW);
+    calls = run_reserve("run 6");
+    CHECK(calls <= NUM_NEW + 2, "run 6: %d stat calls for %d new records", calls, NUM_NEW);
+    CHECK(read_header().scan == NUM_FILES + NUM_NEW, "run 6: scan is %llu (expected %d)", (unsigned long long)read_header().scan, NUM_FILES + NUM_NEW);
+
+    for (int n = 0; n < NUM_FILES + NUM_NEW; n++) {
+        upload_file(n);
+    }
+    unlink(index_path);
+    rmdir(rawdata_dir);
+    rmdir(dir);
+
+    if (failed) {
+        printf("storage_test: FAILED\n");
+        return 1;
+    }
+    printf("storage_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+#!/bin/bash
+# サンプルストアとディスク予算の試験 (make test)。
+# output: both で、アップロードされないWAVファイルがディスク予算を使い切るまでafesimに対してemgetdataを繰り返し実行し、
+# - WAVファイルはサンプリングレートを下げ、最後は特徴量のみになること
+# - その間もサンプルストアには毎回、設定のサンプリングレートで全サンプルが追記されること
+# - 各センサーのストアが sample_store_mb を超えず、古いチャンクから捨てられること
+# を確かめる。
+
+cd "$(dirname "$0")"
+BIN_DIR=$(pwd)
+WORK_DIR=$(mktemp -d)
+PORT=$((40000 + ($$ + 2500) % 10000))
+SAMPLING_RATE=20000
+DURATION=2
+NUM_SENSORS=8
+STORE_MB=0.25 # 1回の取得 (最も周波数の高いA8で約80KB) の数回分
+MAX_RUNS=8
+
+afesim_pid=""
+trap 'if [ -n "$afesim_pid" ]; then kill $afesim_pid 2>/dev/null; fi; rm -rf "$WORK_DIR"' EXIT
+
+failed=0
+
+fail() {
+    echo "FAILED: $*" 1>&2
+    failed=1
+}
+
+{
+    echo "afe_ip: 127.0.0.1"
+    echo "afe_port: ${PORT}"
+    echo "sensors:"
+    for channel in $(seq 1 $NUM_SENSORS); do
+        echo "  - {label: \"A${channel}\", block: \"A\", channel: \"${channel}\", gain: 100}"
+    done
+    echo "sampling_rate: ${SAMPLING_RATE}"
+    echo "afe_format: \"8ch16bit\""
+    echo "output: \"both\""
+    echo "sample_store: \"${WORK_DIR}/store\""
+    echo "sample_store_mb: ${STORE_MB}"
+    echo "disk_budget_mb: 1"
+    echo "rawdata_dir: \"${WORK_DIR}/rawdata\""
+} > "${WORK_DIR}/config.yml"
+
+"${BIN_DIR}/afesim" -p $PORT -F 8ch16bit 2> "${WORK_DIR}/afesim.log" &
+afesim_pid=$!
+sleep 0.3
+
+expected_samples=$(awk -v d=$DURATION -v r=$SAMPLING_RATE 'BEGIN { printf "%d", d * r }')
+store_limit=$(awk -v m=$STORE_MB 'BEGIN { printf "%d", m * 1024 * 1024 }')
+features_only_runs=0
+for run in $(seq 1 $MAX_RUNS); do
+    run_start=$(date +%s.%N)
+    (cd "$WORK_DIR" && "${BIN_DIR}/emgetdata" -f config.yml -t $DURATION) > "${WORK_DIR}/emgetdata.log" 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then
+        cat "${WORK_DIR}/emgetdata.log" 1>&2
+        fail "run ${run}: emgetdata exited with ${status}"
+        break
+    fi
+    wav_mode="full rate"
+    if grep -q "writing features only" "${WORK_DIR}/emgetdata.log"; then
+        wav_mode="features only"
+        features_only_runs=$((features_only_runs + 1))
+    elif grep -q "reducing sampling rate" "${WORK_DIR}/emgetdata.log"; then
+        wav_mode=$(grep "reducing sampling rate" "${WORK_DIR}/emgetdata.log" | tail -1 | sed 's/.*to \([0-9]*\) Hz/\1 Hz/')
+    fi
+
+    # このrunで追記されたチャンク (サンプル数とサンプリングレート) とストアの大きさ
+    for channel in 1 $NUM_SENSORS; do
+        label="A${channel}"
+        result=$("${BIN_DIR}/emstore" -d "${WORK_DIR}/store" -s $label -S -f $run_start 2> /dev/null | awk -F, -v r=$SAMPLING_RATE '
+            { n += $2; if ($3 != r) other++ } END { printf "%d %d", n, other }')
+        read -r samples other_rate <<< "$result"
+        size=$(( $(stat -c %s "${WORK_DIR}/store/${label}.dat") + $(stat -c %s "${WORK_DIR}/store/${label}.idx") ))
+        echo "run ${run}: wav ${wav_mode}, ${label}: ${samples} samples appended to the store, ${size} bytes"
+        if [ "$samples" != "$expected_samples" ] || [ "$other_rate" != "0" ]; then
+            fail "run ${run}: ${label}: ${samples} samples appended to the store (expected ${expected_samples} at ${SAMPLING_RATE} Hz)"
+        fi
+        if [ $size -gt $store_limit ]; then
+            fail "run ${run}: ${label}: the store is ${size} bytes (limit ${store_limit})"
+        fi
+    done
+    if [ $features_only_runs -ge 1 ]; then
+        break
+    fi
+done
+
+kill $afesim_pid 2>/dev/null
+wait $afesim_pid 2>/dev/null
+afesim_pid=""
+
+if [ $features_only_runs -lt 1 ]; then
+    fail "the disk budget is not filled: WAV files are never replaced by features"
+fi
+# 古いチャンクが捨てられていれば、ストアに残るサンプル数は全runの合計より少ない
+stored=$("${BIN_DIR}/emstore" -d "${WORK_DIR}/store" -s A${NUM_SENSORS} -S 2> /dev/null | awk -F, '{ n += $2 } END { printf "%d", n }')
+echo "A${NUM_SENSORS}: ${stored} samples in the store after ${run} runs"
+if [ "$stored" -ge $((expected_samples * run)) ]; then
+    fail "A${NUM_SENSORS}: old chunks are not dropped (${stored} samples after ${run} runs)"
+fi
+
+if [ $failed -ne 0 ]; then
+    echo "store_budget_test: FAILED"
+    exit 1
+fi
+echo "store_budget_test: OK"
@@ -0,0 +1,29 @@
+// emuploadの試験用のS3互換サーバ (s3localパッケージのコマンド)
+package main
+
+import (
+	"flag"
+	"log"
+	"net/http"
+	"os"
+	"time"
+
+	"emupload/s3local"
+)
+
+func main() {
+	addr := flag.String("l", "127.0.0.1:9000", "listen address")
+	data_dir := flag.String("d", "s3local_data", "directory to store the objects (<dir>/<bucket>/<key>)")
+	access_key := flag.String("key", "test", "access key id")
+	secret_key := flag.String("secret", "testsecret", "secret access key")
+	fail_rate := flag.Float64("fail", 0, "ratio of requests to fail with 500 InternalError (0-1)")
+	flag.Parse()
+
+	logger := log.New(os.Stderr, "[s3local] ", log.LstdFlags)
+	server, err := s3local.New(*data_dir, *access_key, *secret_key, *fail_rate, time.Now().UnixNano())
+	if err != nil {
+		logger.Fatal(err)
+	}
+	logger.Println("listening on", *addr, "data:", *data_dir)
+	logger.Fatal(http.ListenAndServe(*addr, server))
+}
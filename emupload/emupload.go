@@ -0,0 +1,783 @@
+// 永続キューを使ってファイルをS3互換のオブジェクトストレージへアップロードするプログラム
+//
+//	emupload add -q queue_dir -d s3://bucket/prefix file...   キューへ追加する (通信しない)
+//	emupload run -q queue_dir [options]                       キューを処理する
+//
+// キューはファイル毎のJSON (queue_dir/*.json) で、マルチパートアップロードの進捗 (UploadId, 完了したパート) も
+// ここに記録するので、中断しても次回のrunで続きから再開できる。ローカルファイルはアップロード後に
+// HEADでサイズを確認してから削除する。標準ライブラリのみを使用する (SigV4署名も自前で行う)。
+package main
+
+import (
+	"bytes"
+	"crypto/hmac"
+	"crypto/md5"
+	"crypto/sha1"
+	"crypto/sha256"
+	"encoding/base64"
+	"encoding/hex"
+	"encoding/json"
+	"encoding/xml"
+	"errors"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"math/rand"
+	"net/http"
+	"net/url"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+var logger = log.New(os.Stderr, "[info] ", log.LstdFlags)
+
+// 再試行の待ち時間の基準 (1回目の待ち時間)。テストでは短くする
+var base_backoff = time.Second
+
+// キューのエントリ (queue_dir/<sha1(path)>.json)
+type Part struct {
+	Number int    `json:"number"`
+	ETag   string `json:"etag"`
+}
+
+type Entry struct {
+	Path      string    `json:"path"`
+	URL       string    `json:"url"` // s3://bucket/key or gs://bucket/key
+	Size      int64     `json:"size"`
+	ModTime   int64     `json:"mtime"`
+	Queued    time.Time `json:"queued"`
+	UploadID  string    `json:"upload_id,omitempty"`
+	PartSize  int64     `json:"part_size,omitempty"`
+	Parts     []Part    `json:"parts,omitempty"`
+	Runs      int       `json:"runs"`
+	LastError string    `json:"last_error,omitempty"`
+
+	state_file string
+}
+
+func usage() {
+	myname := filepath.Base(os.Args[0])
+	fmt.Fprintf(os.Stderr, `Usage of %s:
+   %s add -q queue_dir -d s3://bucket/prefix file...
+   %s run -q queue_dir [OPTIONS]
+`, myname, myname, myname)
+}
+
+func main() {
+	if len(os.Args) < 2 {
+		usage()
+		os.Exit(1)
+	}
+	switch os.Args[1] {
+	case "add":
+		os.Exit(cmd_add(os.Args[2:]))
+	case "run":
+		os.Exit(cmd_run(os.Args[2:]))
+	default:
+		usage()
+		os.Exit(1)
+	}
+}
+
+// ---------------------------------------------------------------- queue
+
+func state_file_of(queue_dir string, path string) string {
+	sum := sha1.Sum([]byte(path))
+	return filepath.Join(queue_dir, hex.EncodeToString(sum[:])+".json")
+}
+
+// 一時ファイルへ書いてfsyncしてからrenameする
+func save_entry(e *Entry) error {
+	data, err := json.MarshalIndent(e, "", "  ")
+	if err != nil {
+		return err
+	}
+	tmp := e.state_file + ".tmp"
+	f, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	if _, err = f.Write(data); err == nil {
+		err = f.Sync()
+	}
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(tmp, e.state_file)
+	}
+	if err != nil {
+		os.Remove(tmp)
+	}
+	return err
+}
+
+func load_entries(queue_dir string) ([]*Entry, error) {
+	files, err := filepath.Glob(filepath.Join(queue_dir, "*.json"))
+	if err != nil {
+		return nil, err
+	}
+	entries := make([]*Entry, 0, len(files))
+	for _, file := range files {
+		data, err := os.ReadFile(file)
+		if err != nil {
+			return nil, err
+		}
+		e := &Entry{}
+		if err := json.Unmarshal(data, e); err != nil {
+			logger.Println("broken queue entry is removed:", file, err)
+			os.Remove(file)
+			continue
+		}
+		e.state_file = file
+		entries = append(entries, e)
+	}
+	sort.Slice(entries, func(i, j int) bool { return entries[i].Queued.Before(entries[j].Queued) })
+	return entries, nil
+}
+
+func cmd_add(args []string) int {
+	fs := flag.NewFlagSet("add", flag.ExitOnError)
+	queue_dir := fs.String("q", "upload_queue", "queue directory")
+	dest := fs.String("d", "", "destination prefix (s3://bucket/prefix or gs://bucket/prefix)")
+	fs.Parse(args)
+	if *dest == "" || fs.NArg() == 0 {
+		usage()
+		fs.PrintDefaults()
+		return 1
+	}
+	if _, _, err := split_url(*dest); err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		return 1
+	}
+	if err := os.MkdirAll(*queue_dir, 0755); err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		return 1
+	}
+
+	for _, file := range fs.Args() {
+		path, err := filepath.Abs(file)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			return 1
+		}
+		st, err := os.Stat(path)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			return 1
+		}
+		e := &Entry{
+			Path:       path,
+			URL:        strings.TrimSuffix(*dest, "/") + "/" + filepath.Base(path),
+			Size:       st.Size(),
+			ModTime:    st.ModTime().UnixNano(),
+			Queued:     time.Now(),
+			state_file: state_file_of(*queue_dir, path),
+		}
+		// 同じファイルが変更されずにキューにあればそのまま (進捗を失わないように)
+		if data, err := os.ReadFile(e.state_file); err == nil {
+			old := &Entry{}
+			if json.Unmarshal(data, old) == nil && old.URL == e.URL && old.Size == e.Size && old.ModTime == e.ModTime {
+				continue
+			}
+		}
+		if err := save_entry(e); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			return 1
+		}
+	}
+	return 0
+}
+
+// ---------------------------------------------------------------- S3 client
+
+type Client struct {
+	http       *http.Client
+	endpoint   string // "" for AWS virtual-hosted style
+	region     string
+	access_key string
+	secret_key string
+	token      string
+	limiter    *Limiter
+	retries    int
+}
+
+type S3Error struct {
+	Status  int
+	Code    string `xml:"Code"`
+	Message string `xml:"Message"`
+}
+
+func (e *S3Error) Error() string {
+	return fmt.Sprintf("%d %s: %s", e.Status, e.Code, e.Message)
+}
+
+// ネットワークエラー、5xx、429は再試行する
+func retryable(err error) bool {
+	var s3err *S3Error
+	if errors.As(err, &s3err) {
+		return s3err.Status >= 500 || s3err.Status == 429 || s3err.Code == "RequestTimeout"
+	}
+	return true
+}
+
+func split_url(u string) (string, string, error) {
+	for _, scheme := range []string{"s3://", "gs://"} {
+		if strings.HasPrefix(u, scheme) {
+			bucket, key, _ := strings.Cut(strings.TrimPrefix(u, scheme), "/")
+			if bucket == "" {
+				break
+			}
+			return bucket, key, nil
+		}
+	}
+	return "", "", fmt.Errorf("invalid destination [%s]. use s3://bucket/prefix or gs://bucket/prefix", u)
+}
+
+// S3のURIエンコード ('/'以外のunreserved以外の文字をすべて%XXにする)
+func uri_encode(s string, keep_slash bool) string {
+	var b strings.Builder
+	for i := 0; i < len(s); i++ {
+		c := s[i]
+		if (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keep_slash) {
+			b.WriteByte(c)
+		} else {
+			fmt.Fprintf(&b, "%%%02X", c)
+		}
+	}
+	return b.String()
+}
+
+func (c *Client) object_url(object_url string, query url.Values) (string, string, error) {
+	bucket, key, err := split_url(object_url)
+	if err != nil {
+		return "", "", err
+	}
+	endpoint := c.endpoint
+	if endpoint == "" && strings.HasPrefix(object_url, "gs://") {
+		endpoint = "https://storage.googleapis.com"
+	}
+	var host, path string
+	if endpoint == "" {
+		host = bucket + ".s3." + c.region + ".amazonaws.com"
+		path = "/" + uri_encode(key, true)
+		endpoint = "https://" + host
+	} else {
+		u, err := url.Parse(endpoint)
+		if err != nil {
+			return "", "", err
+		}
+		host = u.Host
+		path = strings.TrimSuffix(u.Path, "/") + "/" + bucket + "/" + uri_encode(key, true)
+		endpoint = u.Scheme + "://" + u.Host
+	}
+	full := endpoint + path
+	if len(query) > 0 {
+		full += "?" + canonical_query(query)
+	}
+	return full, host, nil
+}
+
+func canonical_query(query url.Values) string {
+	keys := make([]string, 0, len(query))
+	for k := range query {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	parts := make([]string, 0, len(keys))
+	for _, k := range keys {
+		parts = append(parts, uri_encode(k, false)+"="+uri_encode(query.Get(k), false))
+	}
+	return strings.Join(parts, "&")
+}
+
+func hmac_sha256(key []byte, data string) []byte {
+	h := hmac.New(sha256.New, key)
+	h.Write([]byte(data))
+	return h.Sum(nil)
+}
+
+// AWS Signature Version 4
+func sign_v4(req *http.Request, payload_hash string, access_key string, secret_key string, region string, service string, now time.Time) {
+	amz_date := now.UTC().Format("20060102T150405Z")
+	date := amz_date[:8]
+	req.Header.Set("x-amz-date", amz_date)
+
+	headers := map[string]string{"host": req.Host}
+	for name, values := range req.Header {
+		lower := strings.ToLower(name)
+		if strings.HasPrefix(lower, "x-amz-") || lower == "content-md5" || lower == "content-type" {
+			headers[lower] = strings.TrimSpace(strings.Join(values, ","))
+		}
+	}
+	names := make([]string, 0, len(headers))
+	for name := range headers {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	var canonical_headers strings.Builder
+	for _, name := range names {
+		canonical_headers.WriteString(name + ":" + headers[name] + "\n")
+	}
+	signed_headers := strings.Join(names, ";")
+
+	canonical_request := strings.Join([]string{
+		req.Method,
+		req.URL.EscapedPath(),
+		canonical_query(req.URL.Query()),
+		canonical_headers.String(),
+		signed_headers,
+		payload_hash,
+	}, "\n")
+	scope := date + "/" + region + "/" + service + "/aws4_request"
+	request_hash := sha256.Sum256([]byte(canonical_request))
+	string_to_sign := "AWS4-HMAC-SHA256\n" + amz_date + "\n" + scope + "\n" + hex.EncodeToString(request_hash[:])
+
+	key := hmac_sha256([]byte("AWS4"+secret_key), date)
+	key = hmac_sha256(key, region)
+	key = hmac_sha256(key, service)
+	key = hmac_sha256(key, "aws4_request")
+	signature := hex.EncodeToString(hmac_sha256(key, string_to_sign))
+
+	req.Header.Set("Authorization", "AWS4-HMAC-SHA256 Credential="+access_key+"/"+scope+", SignedHeaders="+signed_headers+", Signature="+signature)
+}
+
+// 1回のリクエスト。bodyは帯域制限を掛けて送る
+func (c *Client) do_once(method string, object_url string, query url.Values, body []byte, content_md5 bool) (*http.Response, []byte, error) {
+	full, host, err := c.object_url(object_url, query)
+	if err != nil {
+		return nil, nil, err
+	}
+	req, err := http.NewRequest(method, full, nil)
+	if err != nil {
+		return nil, nil, err
+	}
+	req.Host = host
+	if body != nil {
+		req.ContentLength = int64(len(body))
+		req.Body = io.NopCloser(c.limiter.Reader(bytes.NewReader(body)))
+		if content_md5 {
+			sum := md5.Sum(body)
+			req.Header.Set("Content-MD5", base64.StdEncoding.EncodeToString(sum[:]))
+		}
+	}
+	payload := sha256.Sum256(body)
+	payload_hash := hex.EncodeToString(payload[:])
+	req.Header.Set("x-amz-content-sha256", payload_hash)
+	if c.token != "" {
+		req.Header.Set("x-amz-security-token", c.token)
+	}
+	sign_v4(req, payload_hash, c.access_key, c.secret_key, c.region, "s3", time.Now())
+
+	resp, err := c.http.Do(req)
+	if err != nil {
+		return nil, nil, err
+	}
+	defer resp.Body.Close()
+	resp_body, err := io.ReadAll(resp.Body)
+	if err != nil {
+		return nil, nil, err
+	}
+	// CompleteMultipartUploadは200でもエラーを返すことがある
+	if resp.StatusCode >= 300 || bytes.Contains(resp_body, []byte("<Error>")) {
+		s3err := &S3Error{Status: resp.StatusCode}
+		xml.Unmarshal(resp_body, s3err)
+		if s3err.Status < 300 {
+			s3err.Status = 500
+		}
+		if s3err.Code == "" {
+			s3err.Code = http.StatusText(resp.StatusCode)
+		}
+		return resp, resp_body, s3err
+	}
+	return resp, resp_body, nil
+}
+
+// 再試行付きのリクエスト。待ち時間は1, 2, 4, ... 秒 (最大60秒) にジッタを加えたもの
+func (c *Client) do(method string, object_url string, query url.Values, body []byte, content_md5 bool) (*http.Response, []byte, int, error) {
+	var err error
+	for attempt := 1; ; attempt++ {
+		var resp *http.Response
+		var resp_body []byte
+		resp, resp_body, err = c.do_once(method, object_url, query, body, content_md5)
+		if err == nil || !retryable(err) || attempt > c.retries {
+			return resp, resp_body, attempt, err
+		}
+		backoff := time.Duration(1<<uint(attempt-1)) * base_backoff
+		if backoff > 60*base_backoff {
+			backoff = 60 * base_backoff
+		}
+		backoff = backoff/2 + time.Duration(rand.Int63n(int64(backoff)))
+		logger.Printf("retry %s %s in %v: %v\n", method, object_url, backoff.Round(time.Millisecond), err)
+		time.Sleep(backoff)
+	}
+}
+
+// ---------------------------------------------------------------- bandwidth limiter
+
+// 全転送で共有するトークンバケット。rate <= 0 なら制限しない
+type Limiter struct {
+	mu   sync.Mutex
+	rate float64 // bytes/sec
+	next time.Time
+}
+
+type limited_reader struct {
+	r io.Reader
+	l *Limiter
+}
+
+func (l *Limiter) Reader(r io.Reader) io.Reader {
+	if l.rate <= 0 {
+		return r
+	}
+	return &limited_reader{r, l}
+}
+
+func (lr *limited_reader) Read(p []byte) (int, error) {
+	if len(p) > 16*1024 {
+		p = p[:16*1024]
+	}
+	n, err := lr.r.Read(p)
+	if n > 0 {
+		lr.l.mu.Lock()
+		now := time.Now()
+		if lr.l.next.Before(now) {
+			lr.l.next = now
+		}
+		lr.l.next = lr.l.next.Add(time.Duration(float64(n) / lr.l.rate * float64(time.Second)))
+		wait := lr.l.next.Sub(now)
+		lr.l.mu.Unlock()
+		time.Sleep(wait)
+	}
+	return n, err
+}
+
+// ---------------------------------------------------------------- upload
+
+type Result struct {
+	entry    *Entry
+	latency  time.Duration
+	attempts int
+	err      error
+}
+
+func read_section(path string, offset int64, size int64) ([]byte, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	buf := make([]byte, size)
+	if _, err := f.ReadAt(buf, offset); err != nil && !(err == io.EOF && size == 0) {
+		return nil, err
+	}
+	return buf, nil
+}
+
+func upload_entry(c *Client, e *Entry, part_size int64) (int, error) {
+	attempts := 0
+	if e.Size <= part_size {
+		// 1回のPUTで送る (Content-MD5でサーバに内容を検証させる)
+		data, err := read_section(e.Path, 0, e.Size)
+		if err != nil {
+			return attempts, err
+		}
+		_, _, n, err := c.do("PUT", e.URL, nil, data, true)
+		attempts += n
+		if err != nil {
+			return attempts, err
+		}
+	} else {
+		n, err := upload_multipart(c, e)
+		attempts += n
+		if err != nil {
+			return attempts, err
+		}
+	}
+
+	// サイズを確認できたものだけを完了とする
+	resp, _, n, err := c.do("HEAD", e.URL, nil, nil, false)
+	attempts += n
+	if err != nil {
+		return attempts, fmt.Errorf("failed to confirm the upload: %v", err)
+	}
+	if resp.ContentLength != e.Size {
+		return attempts, fmt.Errorf("size mismatch after upload: local %d, remote %d", e.Size, resp.ContentLength)
+	}
+	return attempts, nil
+}
+
+type initiate_result struct {
+	UploadId string `xml:"UploadId"`
+}
+
+type complete_part struct {
+	PartNumber int    `xml:"PartNumber"`
+	ETag       string `xml:"ETag"`
+}
+
+type complete_request struct {
+	XMLName xml.Name        `xml:"CompleteMultipartUpload"`
+	Parts   []complete_part `xml:"Part"`
+}
+
+// マルチパートアップロード。パート毎に進捗をキューへ記録し、中断されたら続きから再開する
+func upload_multipart(c *Client, e *Entry) (int, error) {
+	attempts := 0
+	for restart := 0; restart < 2; restart++ {
+		if e.UploadID == "" {
+			_, body, n, err := c.do("POST", e.URL, url.Values{"uploads": {""}}, nil, false)
+			attempts += n
+			if err != nil {
+				return attempts, err
+			}
+			result := initiate_result{}
+			if err := xml.Unmarshal(body, &result); err != nil || result.UploadId == "" {
+				return attempts, fmt.Errorf("invalid response to InitiateMultipartUpload: %s", body)
+			}
+			e.UploadID = result.UploadId
+			e.Parts = nil
+			if err := save_entry(e); err != nil {
+				return attempts, err
+			}
+		} else {
+			logger.Printf("resuming %s from part %d\n", e.Path, len(e.Parts)+1)
+		}
+
+		done := make(map[int]bool)
+		for _, p := range e.Parts {
+			done[p.Number] = true
+		}
+		num_parts := int((e.Size + e.PartSize - 1) / e.PartSize)
+		var err error
+		for number := 1; number <= num_parts && err == nil; number++ {
+			if done[number] {
+				continue
+			}
+			offset := int64(number-1) * e.PartSize
+			size := e.PartSize
+			if offset+size > e.Size {
+				size = e.Size - offset
+			}
+			var data []byte
+			data, err = read_section(e.Path, offset, size)
+			if err != nil {
+				return attempts, err
+			}
+			var resp *http.Response
+			var n int
+			query := url.Values{"partNumber": {fmt.Sprint(number)}, "uploadId": {e.UploadID}}
+			resp, _, n, err = c.do("PUT", e.URL, query, data, true)
+			attempts += n
+			if err == nil {
+				e.Parts = append(e.Parts, Part{number, resp.Header.Get("ETag")})
+				err = save_entry(e)
+			}
+		}
+		if err == nil {
+			sort.Slice(e.Parts, func(i, j int) bool { return e.Parts[i].Number < e.Parts[j].Number })
+			request := complete_request{}
+			for _, p := range e.Parts {
+				request.Parts = append(request.Parts, complete_part{p.Number, p.ETag})
+			}
+			body, _ := xml.Marshal(request)
+			var n int
+			_, _, n, err = c.do("POST", e.URL, url.Values{"uploadId": {e.UploadID}}, body, false)
+			attempts += n
+			if err == nil {
+				return attempts, nil
+			}
+		}
+
+		// UploadIdが失効していたら最初からやり直す
+		var s3err *S3Error
+		if errors.As(err, &s3err) && s3err.Code == "NoSuchUpload" {
+			logger.Println("upload id expired. restarting", e.Path)
+			e.UploadID = ""
+			e.Parts = nil
+			continue
+		}
+		return attempts, err
+	}
+	return attempts, fmt.Errorf("multipart upload of %s could not be restarted", e.Path)
+}
+
+// ---------------------------------------------------------------- run
+
+func load_credentials() (string, string, string) {
+	access_key := os.Getenv("AWS_ACCESS_KEY_ID")
+	secret_key := os.Getenv("AWS_SECRET_ACCESS_KEY")
+	token := os.Getenv("AWS_SESSION_TOKEN")
+	if access_key != "" && secret_key != "" {
+		return access_key, secret_key, token
+	}
+	// ~/.aws/credentials の [default] (aws cliと同じもの)
+	profile := os.Getenv("AWS_PROFILE")
+	if profile == "" {
+		profile = "default"
+	}
+	home, _ := os.UserHomeDir()
+	data, err := os.ReadFile(filepath.Join(home, ".aws", "credentials"))
+	if err != nil {
+		return "", "", ""
+	}
+	section := ""
+	for _, line := range strings.Split(string(data), "\n") {
+		line = strings.TrimSpace(line)
+		if strings.HasPrefix(line, "[") && strings.HasSuffix(line, "]") {
+			section = strings.TrimSpace(line[1 : len(line)-1])
+			continue
+		}
+		key, value, found := strings.Cut(line, "=")
+		if !found || section != profile {
+			continue
+		}
+		switch strings.TrimSpace(key) {
+		case "aws_access_key_id":
+			access_key = strings.TrimSpace(value)
+		case "aws_secret_access_key":
+			secret_key = strings.TrimSpace(value)
+		case "aws_session_token":
+			token = strings.TrimSpace(value)
+		}
+	}
+	return access_key, secret_key, token
+}
+
+func cmd_run(args []string) int {
+	fs := flag.NewFlagSet("run", flag.ExitOnError)
+	queue_dir := fs.String("q", "upload_queue", "queue directory")
+	concurrency := fs.Int("c", 4, "number of concurrent transfers")
+	bandwidth := fs.Float64("bw", 0, "total bandwidth limit in KB/s (0: unlimited)")
+	part_mb := fs.Int64("part", 8, "part size of multipart uploads in MB (files up to this size are sent with a single PUT)")
+	retries := fs.Int("retries", 5, "retries per request")
+	endpoint := fs.String("endpoint", "", "S3 compatible endpoint (e.g. http://127.0.0.1:9000). default: AWS S3, or Google Cloud Storage for gs://")
+	default_region := os.Getenv("AWS_REGION")
+	if default_region == "" {
+		default_region = os.Getenv("AWS_DEFAULT_REGION")
+	}
+	if default_region == "" {
+		default_region = "us-east-1"
+	}
+	region := fs.String("region", default_region, "region for the request signature (\"auto\" for Google Cloud Storage)")
+	fs.Parse(args)
+	if *concurrency < 1 || *part_mb < 5 {
+		fmt.Fprintln(os.Stderr, "-c must be >= 1 and -part must be >= 5 (MB)")
+		return 1
+	}
+	part_size := *part_mb * 1024 * 1024
+
+	if err := os.MkdirAll(*queue_dir, 0755); err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		return 1
+	}
+	// 同じキューを複数のrunが同時に処理しないようにする
+	lock, err := os.OpenFile(filepath.Join(*queue_dir, ".lock"), os.O_CREATE|os.O_RDWR, 0644)
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		return 1
+	}
+	defer lock.Close()
+	if err := syscall.Flock(int(lock.Fd()), syscall.LOCK_EX|syscall.LOCK_NB); err != nil {
+		logger.Println("another emupload is processing", *queue_dir)
+		return 0
+	}
+
+	access_key, secret_key, token := load_credentials()
+	if access_key == "" || secret_key == "" {
+		fmt.Fprintln(os.Stderr, "credentials are not found. set AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY or ~/.aws/credentials")
+		return 1
+	}
+	client := &Client{
+		http:       &http.Client{Timeout: 10 * time.Minute},
+		endpoint:   *endpoint,
+		region:     *region,
+		access_key: access_key,
+		secret_key: secret_key,
+		token:      token,
+		limiter:    &Limiter{rate: *bandwidth * 1024},
+		retries:    *retries,
+	}
+
+	entries, err := load_entries(*queue_dir)
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		return 1
+	}
+
+	jobs := make(chan *Entry)
+	results := make(chan Result)
+	var wg sync.WaitGroup
+	for i := 0; i < *concurrency; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for e := range jobs {
+				start := time.Now()
+				attempts, err := upload_entry(client, e, part_size)
+				results <- Result{e, time.Since(start), attempts, err}
+			}
+		}()
+	}
+	go func() {
+		for _, e := range entries {
+			st, err := os.Stat(e.Path)
+			if os.IsNotExist(err) {
+				// 削除後にキューから消す前に止まった場合など
+				logger.Println("local file is gone. removed from the queue:", e.Path)
+				os.Remove(e.state_file)
+				continue
+			}
+			if err == nil && (st.Size() != e.Size || st.ModTime().UnixNano() != e.ModTime) {
+				// キューに入れた後に変更されたファイルは最初から送り直す
+				e.Size, e.ModTime, e.UploadID, e.Parts = st.Size(), st.ModTime().UnixNano(), "", nil
+			}
+			if e.UploadID == "" || e.PartSize == 0 {
+				e.PartSize = part_size
+			}
+			e.Runs++
+			save_entry(e)
+			jobs <- e
+		}
+		close(jobs)
+		wg.Wait()
+		close(results)
+	}()
+
+	start := time.Now()
+	var total_bytes int64
+	uploaded, failed := 0, 0
+	for r := range results {
+		e := r.entry
+		if r.err != nil {
+			failed++
+			e.LastError = r.err.Error()
+			save_entry(e)
+			logger.Printf("failed %s -> %s after %v (%d requests): %v\n", e.Path, e.URL, r.latency.Round(time.Millisecond), r.attempts, r.err)
+			continue
+		}
+		// 確認が取れたのでローカルのファイルを削除し、その後でキューから消す
+		if err := os.Remove(e.Path); err != nil && !os.IsNotExist(err) {
+			logger.Println("failed to remove uploaded file:", err)
+		}
+		os.Remove(e.state_file)
+		uploaded++
+		total_bytes += e.Size
+		logger.Printf("uploaded %s -> %s: %d bytes in %v (%.1f KB/s, %d requests)\n", e.Path, e.URL, e.Size,
+			r.latency.Round(time.Millisecond), float64(e.Size)/1024/r.latency.Seconds(), r.attempts)
+	}
+	elapsed := time.Since(start)
+	logger.Printf("%d uploaded, %d failed, %d bytes in %v (%.1f KB/s)\n", uploaded, failed, total_bytes,
+		elapsed.Round(time.Millisecond), float64(total_bytes)/1024/elapsed.Seconds())
+	if failed > 0 {
+		return 1
+	}
+	return 0
+}
@@ -0,0 +1,184 @@
+package main
+
+import (
+	"bytes"
+	"encoding/xml"
+	"math/rand"
+	"net/http"
+	"net/http/httptest"
+	"net/url"
+	"os"
+	"path/filepath"
+	"sync"
+	"testing"
+	"time"
+
+	"emupload/s3local"
+)
+
+// s3localをhttptestで起動する。partsにはマルチパートのパート番号毎のリクエスト数を数える
+type test_server struct {
+	*httptest.Server
+	data_dir string
+	mu       sync.Mutex
+	parts    map[string]int
+}
+
+func start_server(t *testing.T, fail_rate float64) *test_server {
+	t.Helper()
+	base_backoff = time.Millisecond
+	t.Setenv("AWS_ACCESS_KEY_ID", "test")
+	t.Setenv("AWS_SECRET_ACCESS_KEY", "testsecret")
+	t.Setenv("AWS_SESSION_TOKEN", "")
+
+	ts := &test_server{data_dir: filepath.Join(t.TempDir(), "s3"), parts: map[string]int{}}
+	server, err := s3local.New(ts.data_dir, "test", "testsecret", fail_rate, 1)
+	if err != nil {
+		t.Fatal(err)
+	}
+	ts.Server = httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		if number := r.URL.Query().Get("partNumber"); number != "" {
+			ts.mu.Lock()
+			ts.parts[number]++
+			ts.mu.Unlock()
+		}
+		server.ServeHTTP(w, r)
+	}))
+	t.Cleanup(ts.Close)
+	return ts
+}
+
+func write_random_file(t *testing.T, dir string, name string, size int) (string, []byte) {
+	t.Helper()
+	data := make([]byte, size)
+	rand.New(rand.NewSource(int64(size))).Read(data)
+	path := filepath.Join(dir, name)
+	if err := os.WriteFile(path, data, 0644); err != nil {
+		t.Fatal(err)
+	}
+	return path, data
+}
+
+func check_object(t *testing.T, ts *test_server, key string, want []byte) {
+	t.Helper()
+	got, err := os.ReadFile(filepath.Join(ts.data_dir, "bucket", filepath.FromSlash(key)))
+	if err != nil {
+		t.Fatalf("object %s is not stored: %v", key, err)
+	}
+	if !bytes.Equal(got, want) {
+		t.Fatalf("object %s differs: %d bytes stored, %d bytes expected", key, len(got), len(want))
+	}
+}
+
+func queue_length(t *testing.T, queue_dir string) int {
+	t.Helper()
+	entries, err := load_entries(queue_dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return len(entries)
+}
+
+// 1回のPUT、5MBを超えるマルチパート、空のファイルを、20%のリクエストが失敗するサーバへ送る
+func TestRunWithFailures(t *testing.T) {
+	ts := start_server(t, 0.2)
+	dir := t.TempDir()
+	queue_dir := filepath.Join(dir, "queue")
+	small, small_data := write_random_file(t, dir, "small.wav", 100*1024)
+	large, large_data := write_random_file(t, dir, "large.wav", 12*1024*1024+123)
+	empty, empty_data := write_random_file(t, dir, "empty.wav", 0)
+
+	if cmd_add([]string{"-q", queue_dir, "-d", "s3://bucket/20241018", small, large, empty}) != 0 {
+		t.Fatal("add failed")
+	}
+	if status := cmd_run([]string{"-q", queue_dir, "-endpoint", ts.URL, "-c", "2", "-part", "5", "-retries", "30"}); status != 0 {
+		t.Fatalf("run returned %d", status)
+	}
+
+	check_object(t, ts, "20241018/small.wav", small_data)
+	check_object(t, ts, "20241018/large.wav", large_data)
+	check_object(t, ts, "20241018/empty.wav", empty_data)
+	for _, path := range []string{small, large, empty} {
+		if _, err := os.Stat(path); !os.IsNotExist(err) {
+			t.Errorf("%s is not removed after the upload", path)
+		}
+	}
+	if n := queue_length(t, queue_dir); n != 0 {
+		t.Errorf("%d entries remain in the queue", n)
+	}
+	if ts.parts["3"] == 0 {
+		t.Error("large file is not sent with a multipart upload")
+	}
+}
+
+// 途中まで送ったマルチパートアップロードは、送り終えたパートを送り直さずに続きから再開する
+func TestResumeMultipart(t *testing.T) {
+	ts := start_server(t, 0.2)
+	dir := t.TempDir()
+	queue_dir := filepath.Join(dir, "queue")
+	large, large_data := write_random_file(t, dir, "large.wav", 11*1024*1024)
+	if cmd_add([]string{"-q", queue_dir, "-d", "s3://bucket/resume", large}) != 0 {
+		t.Fatal("add failed")
+	}
+
+	// パート1を送ったところで中断された状態を作る
+	entries, err := load_entries(queue_dir)
+	if err != nil || len(entries) != 1 {
+		t.Fatalf("queue: %v %v", entries, err)
+	}
+	e := entries[0]
+	e.PartSize = 5 * 1024 * 1024
+	client := &Client{http: &http.Client{}, endpoint: ts.URL, region: "us-east-1", access_key: "test", secret_key: "testsecret", limiter: &Limiter{}, retries: 30}
+	_, body, _, err := client.do("POST", e.URL, url.Values{"uploads": {""}}, nil, false)
+	if err != nil {
+		t.Fatal(err)
+	}
+	result := initiate_result{}
+	if err := xml.Unmarshal(body, &result); err != nil || result.UploadId == "" {
+		t.Fatalf("initiate: %s %v", body, err)
+	}
+	e.UploadID = result.UploadId
+	data, _ := read_section(e.Path, 0, e.PartSize)
+	resp, _, _, err := client.do("PUT", e.URL, url.Values{"partNumber": {"1"}, "uploadId": {e.UploadID}}, data, true)
+	if err != nil {
+		t.Fatal(err)
+	}
+	e.Parts = []Part{{1, resp.Header.Get("ETag")}}
+	if err := save_entry(e); err != nil {
+		t.Fatal(err)
+	}
+	ts.mu.Lock()
+	ts.parts = map[string]int{}
+	ts.mu.Unlock()
+
+	if status := cmd_run([]string{"-q", queue_dir, "-endpoint", ts.URL, "-part", "8", "-retries", "30"}); status != 0 {
+		t.Fatalf("run returned %d", status)
+	}
+	check_object(t, ts, "resume/large.wav", large_data)
+	if ts.parts["1"] != 0 {
+		t.Errorf("part 1 is sent again %d times after resuming", ts.parts["1"])
+	}
+	if ts.parts["2"] == 0 || ts.parts["3"] == 0 {
+		t.Errorf("remaining parts are not sent: %v", ts.parts)
+	}
+}
+
+// 送れなかったファイルはローカルにもキューにも残る
+func TestFailureKeepsQueue(t *testing.T) {
+	ts := start_server(t, 1.0)
+	dir := t.TempDir()
+	queue_dir := filepath.Join(dir, "queue")
+	small, _ := write_random_file(t, dir, "small.wav", 1024)
+	if cmd_add([]string{"-q", queue_dir, "-d", "s3://bucket/fail", small}) != 0 {
+		t.Fatal("add failed")
+	}
+	if status := cmd_run([]string{"-q", queue_dir, "-endpoint", ts.URL, "-retries", "2"}); status != 1 {
+		t.Fatalf("run returned %d on failure", status)
+	}
+	if _, err := os.Stat(small); err != nil {
+		t.Errorf("local file is lost: %v", err)
+	}
+	if n := queue_length(t, queue_dir); n != 1 {
+		t.Errorf("%d entries in the queue after the failure", n)
+	}
+}
@@ -0,0 +1,3 @@
+module emupload
+
+go 1.21
@@ -0,0 +1,276 @@
+// emuploadの試験用のS3互換サーバ。オブジェクトをディレクトリに保存する。
+// PUT/HEAD/GET/DELETE と マルチパートアップロード (Initiate/UploadPart/Complete/Abort) のみ対応する。
+// 署名 (AWS SigV4) を検証し、FailRateの割合のリクエストを500で失敗させて再試行を確かめられる。
+// コマンドは cmd/s3local、emuploadのテストはhttptestでこのハンドラを直接使う。
+package s3local
+
+import (
+	"crypto/hmac"
+	"crypto/md5"
+	"crypto/sha256"
+	"encoding/base64"
+	"encoding/hex"
+	"encoding/xml"
+	"fmt"
+	"io"
+	"log"
+	"math/rand"
+	"net/http"
+	"net/url"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+var logger = log.New(os.Stderr, "[s3local] ", log.LstdFlags)
+
+type Server struct {
+	DataDir   string // objects are stored as <DataDir>/<bucket>/<key>
+	AccessKey string
+	SecretKey string
+	FailRate  float64 // ratio of requests to fail with 500 InternalError (0-1)
+
+	mu      sync.Mutex
+	next_id int
+	rand    *rand.Rand
+}
+
+func New(data_dir string, access_key string, secret_key string, fail_rate float64, seed int64) (*Server, error) {
+	if err := os.MkdirAll(filepath.Join(data_dir, ".uploads"), 0755); err != nil {
+		return nil, err
+	}
+	return &Server{DataDir: data_dir, AccessKey: access_key, SecretKey: secret_key, FailRate: fail_rate, rand: rand.New(rand.NewSource(seed))}, nil
+}
+
+// 失敗させるリクエストを選ぶ (同じseedなら同じ順序で失敗する)
+func (s *Server) inject_failure() bool {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	return s.FailRate > 0 && s.rand.Float64() < s.FailRate
+}
+
+func write_error(w http.ResponseWriter, status int, code string, message string) {
+	w.Header().Set("Content-Type", "application/xml")
+	w.WriteHeader(status)
+	fmt.Fprintf(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>%s</Code><Message>%s</Message></Error>", code, message)
+}
+
+func uri_encode(s string, keep_slash bool) string {
+	var b strings.Builder
+	for i := 0; i < len(s); i++ {
+		c := s[i]
+		if (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keep_slash) {
+			b.WriteByte(c)
+		} else {
+			fmt.Fprintf(&b, "%%%02X", c)
+		}
+	}
+	return b.String()
+}
+
+func hmac_sha256(key []byte, data string) []byte {
+	h := hmac.New(sha256.New, key)
+	h.Write([]byte(data))
+	return h.Sum(nil)
+}
+
+// AWS SigV4の検証 (ヘッダによる署名のみ)
+func (s *Server) verify_signature(r *http.Request, payload_hash string) bool {
+	auth := r.Header.Get("Authorization")
+	if !strings.HasPrefix(auth, "AWS4-HMAC-SHA256 ") {
+		return false
+	}
+	fields := map[string]string{}
+	for _, f := range strings.Split(strings.TrimPrefix(auth, "AWS4-HMAC-SHA256 "), ",") {
+		k, v, _ := strings.Cut(strings.TrimSpace(f), "=")
+		fields[k] = v
+	}
+	credential := strings.Split(fields["Credential"], "/")
+	if len(credential) != 5 || credential[0] != s.AccessKey {
+		return false
+	}
+	date, region, service := credential[1], credential[2], credential[3]
+
+	var canonical_headers strings.Builder
+	for _, name := range strings.Split(fields["SignedHeaders"], ";") {
+		value := r.Header.Get(name)
+		if name == "host" {
+			value = r.Host
+		}
+		canonical_headers.WriteString(name + ":" + strings.TrimSpace(value) + "\n")
+	}
+	query := r.URL.Query()
+	keys := make([]string, 0, len(query))
+	for k := range query {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	parts := make([]string, 0, len(keys))
+	for _, k := range keys {
+		parts = append(parts, uri_encode(k, false)+"="+uri_encode(query.Get(k), false))
+	}
+	canonical_request := strings.Join([]string{
+		r.Method,
+		uri_encode(r.URL.Path, true),
+		strings.Join(parts, "&"),
+		canonical_headers.String(),
+		fields["SignedHeaders"],
+		payload_hash,
+	}, "\n")
+	amz_date := r.Header.Get("x-amz-date")
+	scope := date + "/" + region + "/" + service + "/aws4_request"
+	request_hash := sha256.Sum256([]byte(canonical_request))
+	string_to_sign := "AWS4-HMAC-SHA256\n" + amz_date + "\n" + scope + "\n" + hex.EncodeToString(request_hash[:])
+	key := hmac_sha256([]byte("AWS4"+s.SecretKey), date)
+	key = hmac_sha256(key, region)
+	key = hmac_sha256(key, service)
+	key = hmac_sha256(key, "aws4_request")
+	return hmac.Equal([]byte(hex.EncodeToString(hmac_sha256(key, string_to_sign))), []byte(fields["Signature"]))
+}
+
+func (s *Server) object_path(bucket string, key string) string {
+	return filepath.Join(s.DataDir, bucket, filepath.FromSlash(key))
+}
+
+// 一時ファイルに書いてからrenameする (途中で切れたオブジェクトが見えないように)
+func write_file(path string, data []byte) error {
+	if err := os.MkdirAll(filepath.Dir(path), 0755); err != nil {
+		return err
+	}
+	tmp := path + ".tmp"
+	if err := os.WriteFile(tmp, data, 0644); err != nil {
+		return err
+	}
+	return os.Rename(tmp, path)
+}
+
+func (s *Server) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	start := time.Now()
+	body, err := io.ReadAll(r.Body)
+	if err != nil {
+		write_error(w, 400, "IncompleteBody", err.Error())
+		return
+	}
+	sum := sha256.Sum256(body)
+	payload_hash := hex.EncodeToString(sum[:])
+	if r.Header.Get("x-amz-content-sha256") != payload_hash || !s.verify_signature(r, payload_hash) {
+		logger.Println(r.Method, r.URL, "SignatureDoesNotMatch")
+		write_error(w, 403, "SignatureDoesNotMatch", "signature or payload hash mismatch")
+		return
+	}
+	if md5_header := r.Header.Get("Content-MD5"); md5_header != "" {
+		sum := md5.Sum(body)
+		if base64.StdEncoding.EncodeToString(sum[:]) != md5_header {
+			write_error(w, 400, "BadDigest", "Content-MD5 mismatch")
+			return
+		}
+	}
+	if s.inject_failure() {
+		logger.Println(r.Method, r.URL, "injected failure")
+		write_error(w, 500, "InternalError", "injected failure")
+		return
+	}
+
+	bucket, key, _ := strings.Cut(strings.TrimPrefix(r.URL.Path, "/"), "/")
+	if bucket == "" || key == "" || strings.Contains(key, "..") {
+		write_error(w, 400, "InvalidRequest", "path-style bucket/key is required")
+		return
+	}
+	query := r.URL.Query()
+	upload_id := query.Get("uploadId")
+	upload_dir := filepath.Join(s.DataDir, ".uploads", filepath.Base(upload_id))
+	if upload_id != "" {
+		if _, err := os.Stat(upload_dir); err != nil {
+			write_error(w, 404, "NoSuchUpload", "the upload does not exist")
+			return
+		}
+	}
+
+	switch {
+	case r.Method == "POST" && query.Has("uploads"):
+		s.mu.Lock()
+		s.next_id++
+		id := fmt.Sprintf("%d-%d", time.Now().UnixNano(), s.next_id)
+		s.mu.Unlock()
+		os.MkdirAll(filepath.Join(s.DataDir, ".uploads", id), 0755)
+		fmt.Fprintf(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<InitiateMultipartUploadResult><Bucket>%s</Bucket><Key>%s</Key><UploadId>%s</UploadId></InitiateMultipartUploadResult>", bucket, key, id)
+	case r.Method == "PUT" && upload_id != "":
+		number, err := strconv.Atoi(query.Get("partNumber"))
+		if err != nil || number < 1 || number > 10000 {
+			write_error(w, 400, "InvalidArgument", "invalid part number")
+			return
+		}
+		if err := write_file(filepath.Join(upload_dir, fmt.Sprintf("%05d", number)), body); err != nil {
+			write_error(w, 500, "InternalError", err.Error())
+			return
+		}
+		sum := md5.Sum(body)
+		w.Header().Set("ETag", "\""+hex.EncodeToString(sum[:])+"\"")
+	case r.Method == "POST" && upload_id != "":
+		var request struct {
+			Parts []struct {
+				PartNumber int    `xml:"PartNumber"`
+				ETag       string `xml:"ETag"`
+			} `xml:"Part"`
+		}
+		if err := xml.Unmarshal(body, &request); err != nil || len(request.Parts) == 0 {
+			write_error(w, 400, "MalformedXML", "invalid CompleteMultipartUpload")
+			return
+		}
+		var object []byte
+		for i, p := range request.Parts {
+			data, err := os.ReadFile(filepath.Join(upload_dir, fmt.Sprintf("%05d", p.PartNumber)))
+			sum := md5.Sum(data)
+			if err != nil || strings.Trim(p.ETag, "\"") != hex.EncodeToString(sum[:]) {
+				write_error(w, 400, "InvalidPart", fmt.Sprintf("part %d is missing or its etag does not match", p.PartNumber))
+				return
+			}
+			if i > 0 && p.PartNumber <= request.Parts[i-1].PartNumber {
+				write_error(w, 400, "InvalidPartOrder", "parts must be in ascending order")
+				return
+			}
+			if i < len(request.Parts)-1 && len(data) < 5*1024*1024 {
+				write_error(w, 400, "EntityTooSmall", fmt.Sprintf("part %d is smaller than 5MB", p.PartNumber))
+				return
+			}
+			object = append(object, data...)
+		}
+		if err := write_file(s.object_path(bucket, key), object); err != nil {
+			write_error(w, 500, "InternalError", err.Error())
+			return
+		}
+		os.RemoveAll(upload_dir)
+		fmt.Fprintf(w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<CompleteMultipartUploadResult><Bucket>%s</Bucket><Key>%s</Key></CompleteMultipartUploadResult>", bucket, key)
+	case r.Method == "DELETE" && upload_id != "":
+		os.RemoveAll(upload_dir)
+		w.WriteHeader(204)
+	case r.Method == "PUT":
+		if err := write_file(s.object_path(bucket, key), body); err != nil {
+			write_error(w, 500, "InternalError", err.Error())
+			return
+		}
+		sum := md5.Sum(body)
+		w.Header().Set("ETag", "\""+hex.EncodeToString(sum[:])+"\"")
+	case r.Method == "HEAD" || r.Method == "GET":
+		data, err := os.ReadFile(s.object_path(bucket, key))
+		if err != nil {
+			write_error(w, 404, "NoSuchKey", "the key does not exist")
+			return
+		}
+		w.Header().Set("Content-Length", strconv.Itoa(len(data)))
+		if r.Method == "GET" {
+			w.Write(data)
+		}
+	case r.Method == "DELETE":
+		os.Remove(s.object_path(bucket, key))
+		w.WriteHeader(204)
+	default:
+		write_error(w, 405, "MethodNotAllowed", r.Method)
+		return
+	}
+	logger.Printf("%s %s %d bytes %v\n", r.Method, (&url.URL{Path: r.URL.Path, RawQuery: r.URL.RawQuery}).String(), len(body), time.Since(start).Round(time.Millisecond))
+}